@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bench.h"
+#include "arith_uint256.h"
 #include "coins.h"
 #include "policy/policy.h"
 #include "wallet/crypter.h"
@@ -35,14 +36,14 @@ SetupDummyInputs(CBasicKeyStore& keystoreRet, CCoinsViewCache& coinsRet)
     dummyTransactions[0].vout[0].scriptPubKey << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
     dummyTransactions[0].vout[1].nValue = 50 * CENT;
     dummyTransactions[0].vout[1].scriptPubKey << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
-    coinsRet.ModifyCoins(dummyTransactions[0].GetHash())->FromTx(dummyTransactions[0], 0);
+    AddCoins(coinsRet, dummyTransactions[0], 0);
 
     dummyTransactions[1].vout.resize(2);
     dummyTransactions[1].vout[0].nValue = 21 * CENT;
     dummyTransactions[1].vout[0].scriptPubKey = GetScriptForDestination(key[2].GetPubKey().GetID());
     dummyTransactions[1].vout[1].nValue = 22 * CENT;
     dummyTransactions[1].vout[1].scriptPubKey = GetScriptForDestination(key[3].GetPubKey().GetID());
-    coinsRet.ModifyCoins(dummyTransactions[1].GetHash())->FromTx(dummyTransactions[1], 0);
+    AddCoins(coinsRet, dummyTransactions[1], 0);
 
     return dummyTransactions;
 }
@@ -84,4 +85,28 @@ static void CCoinsCaching(benchmark::State& state)
     }
 }
 
+// Fill a cache with coins, look each one up and spend it, and flush: the
+// churn a block connection puts on the coins cache, scaled up.
+static void CCoinsCacheChurn(benchmark::State& state)
+{
+    const uint32_t nCoins = 50000;
+    CScript script = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+    std::vector<COutPoint> outpoints;
+    for (uint32_t i = 0; i < nCoins; i++)
+        outpoints.push_back(COutPoint(ArithToUint256(arith_uint256(i / 4)), i % 4));
+
+    CCoinsView coinsDummy;
+    while (state.KeepRunning()) {
+        CCoinsViewCache coins(&coinsDummy);
+        for (const COutPoint& outpoint : outpoints)
+            coins.AddCoin(outpoint, Coin(CTxOut(CENT, script), 1, false), false);
+        for (const COutPoint& outpoint : outpoints) {
+            assert(!coins.AccessCoin(outpoint).IsSpent());
+            coins.SpendCoin(outpoint);
+        }
+        coins.Flush();
+    }
+}
+
 BENCHMARK(CCoinsCaching);
+BENCHMARK(CCoinsCacheChurn);
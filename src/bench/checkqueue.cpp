@@ -10,6 +10,7 @@
 #include <vector>
 #include <boost/thread/thread.hpp>
 #include "random.h"
+#include "hash.h"
 
 
 // This Benchmark tests the CheckQueue with the lightest
@@ -99,5 +100,53 @@ static void CCheckQueueSpeedPrevectorJob(benchmark::State& state)
     tg.interrupt_all();
     tg.join_all();
 }
+
+// This Benchmark tests how the CheckQueue scales with the number of worker
+// threads, with checks that each do about as much work as a cheap signature
+// hash, added one block's worth at a time.
+template <int nThreads>
+static void CCheckQueueScaling(benchmark::State& state)
+{
+    struct HashJob {
+        uint256 hash;
+        bool operator()()
+        {
+            for (int i = 0; i < 8; i++)
+                hash = Hash(hash.begin(), hash.end());
+            return true;
+        }
+        void swap(HashJob& x){std::swap(hash, x.hash);};
+    };
+    CCheckQueue<HashJob> queue {QUEUE_BATCH_SIZE};
+    boost::thread_group tg;
+    for (auto x = 0; x < nThreads; ++x) {
+       tg.create_thread([&]{queue.Thread();});
+    }
+    while (state.KeepRunning()) {
+        CCheckQueueControl<HashJob> control(&queue);
+        std::vector<std::vector<HashJob>> vBatches(BATCHES);
+        for (auto& vChecks : vBatches) {
+            vChecks.resize(BATCH_SIZE);
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+static void CCheckQueueScaling_0Workers(benchmark::State& state) { CCheckQueueScaling<0>(state); }
+static void CCheckQueueScaling_1Worker(benchmark::State& state) { CCheckQueueScaling<1>(state); }
+static void CCheckQueueScaling_3Workers(benchmark::State& state) { CCheckQueueScaling<3>(state); }
+static void CCheckQueueScaling_7Workers(benchmark::State& state) { CCheckQueueScaling<7>(state); }
+static void CCheckQueueScaling_15Workers(benchmark::State& state) { CCheckQueueScaling<15>(state); }
+static void CCheckQueueScaling_31Workers(benchmark::State& state) { CCheckQueueScaling<31>(state); }
+
 BENCHMARK(CCheckQueueSpeed);
 BENCHMARK(CCheckQueueSpeedPrevectorJob);
+BENCHMARK(CCheckQueueScaling_0Workers);
+BENCHMARK(CCheckQueueScaling_1Worker);
+BENCHMARK(CCheckQueueScaling_3Workers);
+BENCHMARK(CCheckQueueScaling_7Workers);
+BENCHMARK(CCheckQueueScaling_15Workers);
+BENCHMARK(CCheckQueueScaling_31Workers);
@@ -51,6 +51,26 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+// Double-SHA256 of 1024 64-byte inputs, as for the inner nodes of a merkle tree,
+// one input at a time through CHash256 and batched through SHA256D64.
+static void SHA256D64_1024_CHash256(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++) {
+            CHash256().Write(&in[64 * i], 64).Finalize(&in[32 * i]);
+        }
+    }
+}
+
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        SHA256D64(in.data(), in.data(), 1024);
+    }
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -75,4 +95,6 @@ BENCHMARK(SHA256);
 BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024_CHash256);
+BENCHMARK(SHA256D64_1024);
 BENCHMARK(SipHash_32b);
@@ -0,0 +1,118 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+#include "validation.h"
+
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool)
+{
+    int64_t nTime = 0;
+    double dPriority = 10.0;
+    unsigned int nHeight = 1;
+    bool spendsCoinbase = false;
+    unsigned int sigOpCost = 4;
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(
+                                         tx, 1000, nTime, dPriority, nHeight,
+                                         tx->GetValueOut(), spendsCoinbase, sigOpCost, lp));
+}
+
+static CMutableTransaction MakeTx(const std::vector<COutPoint>& vPrevouts, unsigned int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (size_t i = 0; i < vPrevouts.size(); i++) {
+        tx.vin[i].prevout = vPrevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_1;
+    }
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[i].nValue = 10 * COIN;
+    }
+    return tx;
+}
+
+// A mempool of transactions spending random earlier outputs, which makes for
+// wide and deep packages: adding them walks their ancestors, and trimming
+// the pool walks descendants.
+static void ComplexMemPool(benchmark::State& state)
+{
+    FastRandomContext det_rand(true);
+    std::vector<CTransactionRef> vTx;
+    std::vector<COutPoint> vAvailable;
+    for (int i = 0; i < 800; i++) {
+        std::vector<COutPoint> vPrevouts;
+        unsigned int nInputs = 1 + det_rand.rand32() % 3;
+        for (unsigned int j = 0; j < nInputs; j++) {
+            if (vAvailable.empty() || det_rand.rand32() % 8 == 0) {
+                // Spend something outside the mempool
+                vPrevouts.push_back(COutPoint(GetRandHash(), 0));
+            } else {
+                size_t n = det_rand.rand32() % vAvailable.size();
+                vPrevouts.push_back(vAvailable[n]);
+                vAvailable[n] = vAvailable.back();
+                vAvailable.pop_back();
+            }
+        }
+        CTransactionRef tx = MakeTransactionRef(MakeTx(vPrevouts, 1 + det_rand.rand32() % 3));
+        for (unsigned int j = 0; j < tx->vout.size(); j++)
+            vAvailable.push_back(COutPoint(tx->GetHash(), j));
+        vTx.push_back(tx);
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (const auto& tx : vTx)
+            AddTx(tx, pool);
+        pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4);
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    }
+}
+
+// A disconnected block of chained transactions returning to a mempool that
+// holds chains of their spends, as after a reorg: UpdateTransactionsFromBlock
+// has to link them and evict what no longer fits the package limits.
+static void MempoolReorgUpdate(benchmark::State& state)
+{
+    const int nBlockTxs = 50;
+    const int nChildrenPerTx = 4;
+    const int nChainLength = 5;
+
+    std::vector<CTransactionRef> vBlockTx, vMempoolTx;
+    std::vector<uint256> vHashUpdate;
+    COutPoint prevout(GetRandHash(), 0);
+    for (int i = 0; i < nBlockTxs; i++) {
+        CTransactionRef tx = MakeTransactionRef(MakeTx(std::vector<COutPoint>(1, prevout), 1 + nChildrenPerTx));
+        prevout = COutPoint(tx->GetHash(), 0);
+        for (int j = 1; j <= nChildrenPerTx; j++) {
+            COutPoint chainPrevout(tx->GetHash(), j);
+            for (int k = 0; k < nChainLength; k++) {
+                CTransactionRef txChain = MakeTransactionRef(MakeTx(std::vector<COutPoint>(1, chainPrevout), 1));
+                chainPrevout = COutPoint(txChain->GetHash(), 0);
+                vMempoolTx.push_back(txChain);
+            }
+        }
+        vBlockTx.push_back(tx);
+        vHashUpdate.push_back(tx->GetHash());
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        for (const auto& tx : vMempoolTx)
+            AddTx(tx, pool);
+        for (const auto& tx : vBlockTx)
+            AddTx(tx, pool);
+        pool.UpdateTransactionsFromBlock(vHashUpdate, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                         DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000);
+    }
+}
+
+BENCHMARK(ComplexMemPool);
+BENCHMARK(MempoolReorgUpdate);
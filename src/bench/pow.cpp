@@ -0,0 +1,250 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "arith_uint256.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "pow.h"
+#include "powcache.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "crypto/scrypt.h"
+#include "hash/yescrypt/yescrypt-hash.h"
+#include "primitives/block.h"
+
+#include <memory>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+
+// Benchmarks for the proof-of-work code paths: YescryptR16 hashing (with and
+// without reused scratch memory, singly and batched, on one and on all
+// cores), the legacy scrypt kernels, and the checks (one header at a time and
+// paired, as the PoW check threads hash them) and difficulty calculation done
+// for every header.
+
+/* Number of headers hashed per iteration by the batch and threaded benchmarks */
+static const size_t POW_BATCH_SIZE = 8;
+
+static CBlockHeader PoWBenchHeader(uint32_t nNonce)
+{
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = uint256S("0babe680f55a55d54339511226755f0837261da89a4e78eba4d6436a63026df8");
+    header.hashMerkleRoot = uint256S("4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    header.nTime = 1500000000;
+    header.nBits = UintToArith256(Params(CBaseChainParams::MAIN).GetConsensus().powLimit).GetCompact();
+    header.nNonce = nNonce;
+    return header;
+}
+
+// One-shot API: allocates and frees the scratch memory on every call.
+static void YescryptHash(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        yescrypt_hash(BEGIN(header.nVersion), BEGIN(hash));
+        header.nNonce++;
+    }
+}
+
+// Scratch memory allocated once and reused, as the PoW check threads do.
+static void YescryptHashContext(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    YescryptContext context;
+    uint256 hash;
+    while (state.KeepRunning()) {
+        context.Hash(BEGIN(header.nVersion), BEGIN(hash));
+        header.nNonce++;
+    }
+}
+
+static void YescryptHashContextHugePages(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    YescryptContext context(true);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        context.Hash(BEGIN(header.nVersion), BEGIN(hash));
+        header.nNonce++;
+    }
+}
+
+// Cost of setting up scratch memory, including faulting it in with a first hash.
+static void YescryptContextAlloc(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        YescryptContext context;
+        context.Hash(BEGIN(header.nVersion), BEGIN(hash));
+    }
+}
+
+static void YescryptHashMany(benchmark::State& state)
+{
+    std::vector<CBlockHeader> headers;
+    for (size_t i = 0; i < POW_BATCH_SIZE; i++)
+        headers.push_back(PoWBenchHeader(i));
+    std::vector<uint256> hashes(POW_BATCH_SIZE);
+    YescryptContext context;
+    while (state.KeepRunning()) {
+        context.HashMany(BEGIN(headers[0].nVersion), BEGIN(hashes[0]), headers.size());
+    }
+}
+
+static void HashHeaders(YescryptContext* context, uint32_t nFirstNonce)
+{
+    uint256 hash;
+    for (uint32_t i = 0; i < POW_BATCH_SIZE; i++) {
+        CBlockHeader header = PoWBenchHeader(nFirstNonce + i);
+        context->Hash(BEGIN(header.nVersion), BEGIN(hash));
+    }
+}
+
+// Throughput with every core hashing POW_BATCH_SIZE headers per iteration,
+// each thread with its own scratch memory.
+static void YescryptHashThreads(benchmark::State& state)
+{
+    std::vector<std::unique_ptr<YescryptContext> > contexts;
+    for (int i = 0; i < GetNumCores(); i++)
+        contexts.emplace_back(new YescryptContext());
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (size_t i = 0; i < contexts.size(); i++)
+            threads.create_thread(boost::bind(&HashHeaders, contexts[i].get(), i * POW_BATCH_SIZE));
+        threads.join_all();
+    }
+}
+
+static void BlockHeaderGetPoWHash(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    while (state.KeepRunning()) {
+        header.GetPoWHash();
+        header.nNonce++;
+    }
+}
+
+static void ScryptGeneric(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_generic(BEGIN(header.nVersion), BEGIN(hash), scratchpad);
+        header.nNonce++;
+    }
+}
+
+#if defined(USE_SSE2)
+static void ScryptSSE2(benchmark::State& state)
+{
+    CBlockHeader header = PoWBenchHeader(0);
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_sse2(BEGIN(header.nVersion), BEGIN(hash), scratchpad);
+        header.nNonce++;
+    }
+}
+#endif
+
+static void CheckProofOfWorkBench(benchmark::State& state)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    CBlockHeader header = PoWBenchHeader(0);
+    uint256 hash = header.GetPoWHash();
+    while (state.KeepRunning()) {
+        CheckProofOfWork(hash, header.nBits, params);
+    }
+}
+
+// Cached check of two fresh headers per iteration, one call each, as every
+// header of a batch was checked before the checks were paired...
+static void CheckProofOfWorkCachedSingle(benchmark::State& state)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    InitPoWCache();
+    YescryptContext context;
+    CBlockHeader headers[2] = {PoWBenchHeader(0), PoWBenchHeader(1)};
+    while (state.KeepRunning()) {
+        for (CBlockHeader& header : headers) {
+            CheckProofOfWorkCached(header, params, &context);
+            header.nNonce += 2;
+        }
+    }
+}
+
+// ...and both in one call, hashed together as a CPoWCheck does.
+static void CheckProofOfWorkCachedPaired(benchmark::State& state)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    InitPoWCache();
+    YescryptContext context;
+    CBlockHeader headers[2] = {PoWBenchHeader(0), PoWBenchHeader(1)};
+    const CBlockHeader* pheaders[2] = {&headers[0], &headers[1]};
+    bool fValid[2];
+    while (state.KeepRunning()) {
+        CheckProofOfWorkCached(pheaders, 2, params, &context, fValid);
+        for (CBlockHeader& header : headers)
+            header.nNonce += 2;
+    }
+}
+
+static void SetupDifficultyChain(std::vector<CBlockIndex>& blocks, const Consensus::Params& params)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = 1500000000 + i * params.nPowTargetSpacing;
+        blocks[i].nBits = 0x1e0ffff0;
+    }
+}
+
+// Next work required on top of a chain of evenly spaced blocks, with the
+// memoized value dropped so that the whole averaging window is walked.
+static void GetNextWorkRequiredBench(benchmark::State& state)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    std::vector<CBlockIndex> blocks(100);
+    SetupDifficultyChain(blocks, params);
+    while (state.KeepRunning()) {
+        blocks.back().pparamsNextWork = NULL;
+        GetNextWorkRequired(&blocks.back(), NULL, params);
+    }
+}
+
+// Repeated lookups for the same tip, as getblocktemplate and CheckBlockIndex do.
+static void GetNextWorkRequiredCached(benchmark::State& state)
+{
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    std::vector<CBlockIndex> blocks(100);
+    SetupDifficultyChain(blocks, params);
+    while (state.KeepRunning()) {
+        GetNextWorkRequired(&blocks.back(), NULL, params);
+    }
+}
+
+BENCHMARK(YescryptHash);
+BENCHMARK(YescryptHashContext);
+BENCHMARK(YescryptHashContextHugePages);
+BENCHMARK(YescryptContextAlloc);
+BENCHMARK(YescryptHashMany);
+BENCHMARK(YescryptHashThreads);
+BENCHMARK(BlockHeaderGetPoWHash);
+BENCHMARK(ScryptGeneric);
+#if defined(USE_SSE2)
+BENCHMARK(ScryptSSE2);
+#endif
+BENCHMARK(CheckProofOfWorkBench);
+BENCHMARK(CheckProofOfWorkCachedSingle);
+BENCHMARK(CheckProofOfWorkCachedPaired);
+BENCHMARK(GetNextWorkRequiredBench);
+BENCHMARK(GetNextWorkRequiredCached);
@@ -3,13 +3,16 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bench.h"
+#include "hash.h"
 #include "key.h"
 #if defined(HAVE_CONSENSUS_LIB)
 #include "script/bitcoinconsensus.h"
 #endif
 #include "script/script.h"
+#include "script/sigcache.h"
 #include "script/sign.h"
 #include "streams.h"
+#include "utilstrencodings.h"
 
 // FIXME: Dedup with BuildCreditingTransaction in test/script_tests.cpp.
 static CMutableTransaction BuildCreditingTransaction(const CScript& scriptPubKey)
@@ -99,4 +102,56 @@ static void VerifyScriptBench(benchmark::State& state)
     }
 }
 
+// Verification of many signatures under one compressed key, as in a block
+// paying out to a pool's address: parsing the key for every signature, and
+// parsing it once through a CPubKeyParseCache.
+static const int REUSED_KEY_SIGNATURES = 100;
+
+static void SignWithReusedKey(CPubKey& pubkey, std::vector<uint256>& hashes, std::vector<std::vector<unsigned char> >& sigs)
+{
+    CKey key;
+    const unsigned char vchKey[32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    key.Set(vchKey, vchKey + 32, true);
+    pubkey = key.GetPubKey();
+    hashes.resize(REUSED_KEY_SIGNATURES);
+    sigs.resize(REUSED_KEY_SIGNATURES);
+    for (int i = 0; i < REUSED_KEY_SIGNATURES; i++) {
+        hashes[i] = Hash(BEGIN(i), END(i));
+        key.Sign(hashes[i], sigs[i]);
+    }
+}
+
+static void VerifyECDSAReusedKey(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    CPubKey pubkey;
+    std::vector<uint256> hashes;
+    std::vector<std::vector<unsigned char> > sigs;
+    SignWithReusedKey(pubkey, hashes, sigs);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < REUSED_KEY_SIGNATURES; i++) {
+            bool success = pubkey.Verify(hashes[i], sigs[i]);
+            assert(success);
+        }
+    }
+}
+
+static void VerifyECDSAReusedKeyParseCache(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    CPubKey pubkey;
+    std::vector<uint256> hashes;
+    std::vector<std::vector<unsigned char> > sigs;
+    SignWithReusedKey(pubkey, hashes, sigs);
+    while (state.KeepRunning()) {
+        CPubKeyParseCache pkcache;
+        for (int i = 0; i < REUSED_KEY_SIGNATURES; i++) {
+            bool success = pkcache.Verify(pubkey, hashes[i], sigs[i]);
+            assert(success);
+        }
+    }
+}
+
 BENCHMARK(VerifyScriptBench);
+BENCHMARK(VerifyECDSAReusedKey);
+BENCHMARK(VerifyECDSAReusedKeyParseCache);
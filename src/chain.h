@@ -146,6 +146,8 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    BLOCK_POW_VERIFIED      =   256, //!< header PoW hash was checked on acceptance; disk reads only compare the header hash
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -205,6 +207,11 @@ public:
     //! (memory only) Maximum nTime in the chain upto and including this block.
     unsigned int nTimeMax;
 
+    //! (memory only) Memoized GetNextWorkRequired() for a child of this block, computed under
+    //! pparamsNextWork (NULL if not computed yet). Protected by cs_main like the rest of the index.
+    mutable unsigned int nNextWorkRequired;
+    mutable const Consensus::Params* pparamsNextWork;
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -220,6 +227,8 @@ public:
         nStatus = 0;
         nSequenceId = 0;
         nTimeMax = 0;
+        nNextWorkRequired = 0;
+        pparamsNextWork = NULL;
 
         nVersion       = 0;
         hashMerkleRoot = uint256();
@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
-#include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,12 +27,53 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker owns a deque of verifications, each with its own lock, and
+  * the master spreads added batches over them. Workers take from the back
+  * of their own deque and, once it is empty, steal from the front of the
+  * others', so the hot path never touches a lock shared by all threads.
+  * Completion is tracked with an atomic counter; the shared mutex is only
+  * used to put idle threads to sleep and wake them up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! A worker's deque of verifications.
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> checks;
+        //! Number of elements in checks, readable without taking the lock.
+        std::atomic<int> nSize;
+
+        WorkerQueue() : nSize(0) {}
+    };
+
+    //! Maximum number of deques; workers beyond that share them. Slot 0 belongs to the master.
+    static const int MAX_QUEUES = 64;
+
+    //! Per-worker deques, allocated up front so that they can be scanned without locking.
+    std::vector<std::unique_ptr<WorkerQueue> > vQueues;
+
+    //! Number of worker threads that ever joined. Never decreases, so the
+    //! range of deques that may hold work only grows.
+    std::atomic<int> nWorkers;
+
+    //! Number of queued verifications not yet taken by a thread. May be
+    //! briefly negative while an Add and a take race.
+    std::atomic<int> nQueued;
+
+    /**
+     * Number of verifications that haven't completed yet.
+     * This includes elements that are no longer queued, but still in a
+     * thread's own batch.
+     */
+    std::atomic<unsigned int> nTodo;
+
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
+
+    //! Mutex for sleeping and waking up threads
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,122 +82,163 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The number of workers that are sleeping on condWorker.
+    std::atomic<int> nIdle;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The maximum number of elements to be processed in one batch
+    unsigned int nBatchSize;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Next deque to receive work (master only).
+    int nNextQueue;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Number of deques that work may be in.
+    int QueuesInUse() const
+    {
+        int nInUse = nWorkers.load() + 1;
+        return nInUse < MAX_QUEUES ? nInUse : MAX_QUEUES;
+    }
 
     /**
-     * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * Move up to nBatchSize verifications from a deque into vChecks, leaving
+     * at least half of them for other threads. The owner takes from the back,
+     * thieves from the front.
      */
-    unsigned int nTodo;
-
-    //! Whether we're shutting down.
-    bool fQuit;
+    bool TakeFrom(WorkerQueue& wq, std::vector<T>& vChecks, bool fSteal)
+    {
+        if (wq.nSize.load(std::memory_order_relaxed) <= 0)
+            return false;
+        unsigned int nNow = 0;
+        {
+            boost::unique_lock<boost::mutex> lock(wq.mutex);
+            if (wq.checks.empty())
+                return false;
+            nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(wq.checks.size() + 1) / 2));
+            vChecks.resize(nNow);
+            for (unsigned int i = 0; i < nNow; i++) {
+                // Swap jobs out of the deque instead of copying them.
+                T& check = fSteal ? wq.checks.front() : wq.checks.back();
+                vChecks[i].swap(check);
+                if (fSteal)
+                    wq.checks.pop_front();
+                else
+                    wq.checks.pop_back();
+            }
+            wq.nSize -= nNow;
+        }
+        nQueued -= nNow;
+        return true;
+    }
 
-    //! The maximum number of elements to be processed in one batch
-    unsigned int nBatchSize;
+    //! Take a batch from this thread's own deque, or steal one from another.
+    bool Take(int nQueue, std::vector<T>& vChecks)
+    {
+        if (TakeFrom(*vQueues[nQueue], vChecks, false))
+            return true;
+        int nInUse = QueuesInUse();
+        for (int i = 1; i < nInUse; i++) {
+            if (TakeFrom(*vQueues[(nQueue + i) % nInUse], vChecks, true))
+                return true;
+        }
+        return false;
+    }
 
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(int nQueue, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
+            if (!Take(nQueue, vChecks)) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+                if (fMaster) {
+                    // Only the master adds work, so everything left is
+                    // already in another thread's batch: wait for it.
+                    while (nTodo.load() != 0)
+                        condMaster.wait(lock);
+                    // return the current status, and reset it for new work later
+                    return fAllOk.exchange(true);
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                // Announce being idle before checking for work, so that an
+                // Add either sees the announcement or its work is seen here.
+                nIdle++;
+                while (nQueued.load() <= 0)
+                    condWorker.wait(lock); // wait
+                nIdle--;
+                continue;
             }
+            // Check whether we need to do work at all
+            bool fOk = fAllOk.load(std::memory_order_relaxed);
             // execute work
-            BOOST_FOREACH (T& check, vChecks)
+            for (T& check : vChecks)
                 if (fOk)
                     fOk = check();
+            if (!fOk)
+                fAllOk = false;
+            unsigned int nNow = vChecks.size();
             vChecks.clear();
+            if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_one();
+            }
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nWorkers(0), nQueued(0), nTodo(0), fAllOk(true), nIdle(0), nBatchSize(nBatchSizeIn), nNextQueue(0)
+    {
+        vQueues.reserve(MAX_QUEUES);
+        for (int i = 0; i < MAX_QUEUES; i++)
+            vQueues.emplace_back(new WorkerQueue());
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        int nQueue = 1 + nWorkers++ % (MAX_QUEUES - 1);
+        Loop(nQueue);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // Count the work before anyone can take (and complete) it.
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+
+        // Spread the batch over the workers' deques, or keep it for the
+        // master if there are none.
+        int nInUse = QueuesInUse();
+        int nTargets = std::max(1, nInUse - 1);
+        size_t nChunk = (vChecks.size() + nTargets - 1) / nTargets;
+        for (size_t nPos = 0; nPos < vChecks.size(); nPos += nChunk) {
+            int nQueue = nInUse > 1 ? 1 + nNextQueue++ % (nInUse - 1) : 0;
+            size_t nEnd = std::min(vChecks.size(), nPos + nChunk);
+            WorkerQueue& wq = *vQueues[nQueue];
+            boost::unique_lock<boost::mutex> lock(wq.mutex);
+            for (size_t i = nPos; i < nEnd; i++) {
+                wq.checks.push_back(T());
+                vChecks[i].swap(wq.checks.back());
+            }
+            wq.nSize += nEnd - nPos;
+        }
+        nQueued += vChecks.size();
+
+        if (nIdle.load() > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
@@ -163,8 +247,7 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo.load() == 0 && fAllOk.load() == true);
     }
 
 };
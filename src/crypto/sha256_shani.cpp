@@ -0,0 +1,186 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 using the x86 SHA extensions: a single-stream transform, and a
+// double-SHA256 of two 64-byte inputs with the streams interleaved to hide
+// the latency of the SHA instructions. Built with SHA-NI enabled and only
+// called after runtime CPU detection.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#ifdef ENABLE_SHANI
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace {
+
+alignas(16) const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/* Byte swap of each 32-bit word. */
+alignas(16) const uint8_t MASK[16] = {0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04, 0x0b, 0x0a, 0x09, 0x08, 0x0f, 0x0e, 0x0d, 0x0c};
+
+/* Initial state, already in the ABEF/CDGH layout used by the SHA instructions. */
+alignas(16) const uint32_t INIT0[4] = {0x9b05688c, 0x510e527f, 0xbb67ae85, 0x6a09e667};
+alignas(16) const uint32_t INIT1[4] = {0x5be0cd19, 0x1f83d9ab, 0xa54ff53a, 0x3c6ef372};
+
+__m128i inline Load(const unsigned char* in)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), _mm_load_si128((const __m128i*)MASK));
+}
+
+void inline Save(unsigned char* out, __m128i s)
+{
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(s, _mm_load_si128((const __m128i*)MASK)));
+}
+
+/** Convert DCBA/HGFE state words into the ABEF/CDGH layout. */
+void inline Shuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+/** Convert ABEF/CDGH state words back into the DCBA/HGFE layout. */
+void inline Unshuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+}
+
+/** Rounds 4q..4q+3, with the message words in m[q % 4]. */
+void inline QuadRound(__m128i& s0, __m128i& s1, const __m128i* m, int q)
+{
+    const __m128i msg = _mm_add_epi32(m[q & 3], _mm_load_si128((const __m128i*)&K[4 * q]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+}
+
+/** Extend the message schedule after quad round q, overwriting m in place. */
+void inline ShiftMessage(__m128i* m, int q)
+{
+    if (q >= 3 && q < 15) {
+        m[(q + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(q + 1) & 3], _mm_alignr_epi8(m[q & 3], m[(q + 3) & 3], 4)), m[q & 3]);
+    }
+    if (q >= 1 && q < 13) {
+        m[(q + 3) & 3] = _mm_sha256msg1_epu32(m[(q + 3) & 3], m[q & 3]);
+    }
+}
+
+/** Compress one block, given as four vectors of message words, into s0/s1. */
+void inline Compress(__m128i& s0, __m128i& s1, __m128i* m)
+{
+    const __m128i save0 = s0, save1 = s1;
+    for (int q = 0; q < 16; q++) {
+        QuadRound(s0, s1, m, q);
+        ShiftMessage(m, q);
+    }
+    s0 = _mm_add_epi32(s0, save0);
+    s1 = _mm_add_epi32(s1, save1);
+}
+
+/** Compress one block for each of two independent streams, interleaving their instructions. */
+void inline Compress2(__m128i& as0, __m128i& as1, __m128i* am, __m128i& bs0, __m128i& bs1, __m128i* bm)
+{
+    const __m128i asave0 = as0, asave1 = as1, bsave0 = bs0, bsave1 = bs1;
+    for (int q = 0; q < 16; q++) {
+        QuadRound(as0, as1, am, q);
+        QuadRound(bs0, bs1, bm, q);
+        ShiftMessage(am, q);
+        ShiftMessage(bm, q);
+    }
+    as0 = _mm_add_epi32(as0, asave0);
+    as1 = _mm_add_epi32(as1, asave1);
+    bs0 = _mm_add_epi32(bs0, bsave0);
+    bs1 = _mm_add_epi32(bs1, bsave1);
+}
+
+/** Message words of the padding block that follows a 64-byte message. */
+void inline PaddingBlock(__m128i* m)
+{
+    m[0] = _mm_set_epi32(0, 0, 0, 0x80000000);
+    m[1] = _mm_setzero_si128();
+    m[2] = _mm_setzero_si128();
+    m[3] = _mm_set_epi32(0x200, 0, 0, 0);
+}
+
+/** Message words of a 32-byte hash (in ABEF/CDGH layout) followed by its padding. */
+void inline HashBlock(__m128i* m, __m128i s0, __m128i s1)
+{
+    Unshuffle(s0, s1);
+    m[0] = s0;
+    m[1] = s1;
+    m[2] = _mm_set_epi32(0, 0, 0, 0x80000000);
+    m[3] = _mm_set_epi32(0x100, 0, 0, 0);
+}
+
+} // namespace
+
+namespace sha256_shani {
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(s0, s1);
+
+    while (blocks--) {
+        __m128i m[4] = {Load(chunk), Load(chunk + 16), Load(chunk + 32), Load(chunk + 48)};
+        Compress(s0, s1, m);
+        chunk += 64;
+    }
+
+    Unshuffle(s0, s1);
+    _mm_storeu_si128((__m128i*)s, s0);
+    _mm_storeu_si128((__m128i*)(s + 4), s1);
+}
+}
+
+namespace sha256d64_shani {
+void Transform_2way(unsigned char* out, const unsigned char* in)
+{
+    __m128i am[4], bm[4];
+
+    // First hash: the 64-byte input, then a padding block for a 512-bit message.
+    __m128i as0 = _mm_load_si128((const __m128i*)INIT0), as1 = _mm_load_si128((const __m128i*)INIT1);
+    __m128i bs0 = as0, bs1 = as1;
+    for (int i = 0; i < 4; i++) {
+        am[i] = Load(in + 16 * i);
+        bm[i] = Load(in + 64 + 16 * i);
+    }
+    Compress2(as0, as1, am, bs0, bs1, bm);
+    PaddingBlock(am);
+    PaddingBlock(bm);
+    Compress2(as0, as1, am, bs0, bs1, bm);
+
+    // Second hash: the 32-byte first hash, padded in the same block.
+    HashBlock(am, as0, as1);
+    HashBlock(bm, bs0, bs1);
+    as0 = bs0 = _mm_load_si128((const __m128i*)INIT0);
+    as1 = bs1 = _mm_load_si128((const __m128i*)INIT1);
+    Compress2(as0, as1, am, bs0, bs1, bm);
+
+    Unshuffle(as0, as1);
+    Unshuffle(bs0, bs1);
+    Save(out, as0);
+    Save(out + 16, as1);
+    Save(out + 32, bs0);
+    Save(out + 48, bs1);
+}
+}
+
+#endif
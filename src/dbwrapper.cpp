@@ -6,6 +6,8 @@
 
 #include "util.h"
 #include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
 
 #include <boost/filesystem.hpp>
 
@@ -14,15 +16,58 @@
 #include <leveldb/filter_policy.h>
 #include <memenv.h>
 #include <stdint.h>
+#include <stdio.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+#include <sstream>
+
+//! LevelDB starts slowing writes down once level 0 holds this many files
+static const int LEVELDB_L0_SLOWDOWN_WRITES_TRIGGER = 8;
+
+namespace {
+
+/** Block cache that counts hits and misses of the LRU cache it wraps */
+class CCountingCache : public leveldb::Cache
+{
+private:
+    leveldb::Cache* pcache;
+    std::atomic<uint64_t>& nHits;
+    std::atomic<uint64_t>& nMisses;
+
+public:
+    CCountingCache(leveldb::Cache* pcacheIn, std::atomic<uint64_t>& nHitsIn, std::atomic<uint64_t>& nMissesIn) : pcache(pcacheIn), nHits(nHitsIn), nMisses(nMissesIn) {}
+    ~CCountingCache() { delete pcache; }
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge, void (*deleter)(const leveldb::Slice& key, void* value))
+    {
+        return pcache->Insert(key, value, charge, deleter);
+    }
+    Handle* Lookup(const leveldb::Slice& key)
+    {
+        Handle* handle = pcache->Lookup(key);
+        if (handle)
+            nHits++;
+        else
+            nMisses++;
+        return handle;
+    }
+    void Release(Handle* handle) { pcache->Release(handle); }
+    void* Value(Handle* handle) { return pcache->Value(handle); }
+    void Erase(const leveldb::Slice& key) { pcache->Erase(key); }
+    uint64_t NewId() { return pcache->NewId(); }
+    void Prune() { pcache->Prune(); }
+    size_t TotalCharge() const { return pcache->TotalCharge(); }
+};
+
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.block_cache = leveldb::NewLRUCache(nCacheSize * dbOptions.nBlockCachePercent / 100);
+    options.write_buffer_size = nCacheSize * dbOptions.nWriteBufferPercent / 100;
+    options.filter_policy = dbOptions.nBloomFilterBits > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomFilterBits) : NULL;
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +76,16 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbOptions) :
+    nCacheHits(0), nCacheMisses(0), nStalledWrites(0)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbOptions);
+    options.block_cache = new CCountingCache(options.block_cache, nCacheHits, nCacheMisses);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -90,11 +137,96 @@ CDBWrapper::~CDBWrapper()
 
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
+    std::string strFiles;
+    if (pdb->GetProperty("leveldb.num-files-at-level0", &strFiles) && atoi(strFiles) >= LEVELDB_L0_SLOWDOWN_WRITES_TRIGGER)
+        nStalledWrites++;
+    int64_t nTimeStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    histWrites.Add(GetTimeMicros() - nTimeStart);
     dbwrapper_private::HandleError(status);
     return true;
 }
 
+bool CDBWrapper::ReadRaw(const leveldb::Slice& slKey, std::string& strValue) const
+{
+    int64_t nTimeStart = GetTimeMicros();
+    leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+    histReads.Add(GetTimeMicros() - nTimeStart);
+    if (!status.ok()) {
+        if (status.IsNotFound())
+            return false;
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        dbwrapper_private::HandleError(status);
+    }
+    return true;
+}
+
+void CDBWrapper::GetStats(CDBStats& stats) const
+{
+    stats.nCacheHits = nCacheHits;
+    stats.nCacheMisses = nCacheMisses;
+    stats.nStalledWrites = nStalledWrites;
+    stats.reads = histReads.Get();
+    stats.writes = histWrites.Get();
+
+    std::string strValue;
+    stats.nMemoryUsage = pdb->GetProperty("leveldb.approximate-memory-usage", &strValue) ? atoi64(strValue) : 0;
+
+    // Rows of the compaction table in "leveldb.stats": level, files, size
+    // (MB), compaction time (s), compaction read and written (MB).
+    stats.vLevels.clear();
+    if (pdb->GetProperty("leveldb.stats", &strValue)) {
+        std::istringstream stream(strValue);
+        std::string strLine;
+        while (std::getline(stream, strLine)) {
+            CDBLevelStats level;
+            if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &level.nLevel, &level.nFiles, &level.dSizeMB,
+                       &level.dCompactionSec, &level.dCompactionReadMB, &level.dCompactionWriteMB) == 6)
+                stats.vLevels.push_back(level);
+        }
+    }
+}
+
+std::string CDBStats::ToString() const
+{
+    std::string strLevels;
+    for (const CDBLevelStats& level : vLevels)
+        strLevels += strprintf(" L%d=%d/%.0fMB", level.nLevel, level.nFiles, level.dSizeMB);
+    uint64_t nLookups = nCacheHits + nCacheMisses;
+    return strprintf("block cache hit rate %.1f%% of %u, reads %u (avg %.1fus), writes %u (avg %.1fus, %u stalled), memory %.1fMiB, files/size per level:%s",
+        nLookups ? 100.0 * nCacheHits / nLookups : 0.0, nLookups,
+        reads.nCount, reads.nCount ? (double)reads.nTotalMicros / reads.nCount : 0.0,
+        writes.nCount, writes.nCount ? (double)writes.nTotalMicros / writes.nCount : 0.0, nStalledWrites,
+        nMemoryUsage * (1.0 / 1024 / 1024), strLevels);
+}
+
+CDBLatencyHistogram::CDBLatencyHistogram() : nCount(0), nTotalMicros(0)
+{
+    for (int i = 0; i < CDBLatencyStats::BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CDBLatencyHistogram::Add(int64_t nMicros)
+{
+    nMicros = std::max<int64_t>(nMicros, 0); // The clock may have been adjusted
+    int nBucket = 0;
+    while (nBucket < CDBLatencyStats::BUCKETS - 1 && nMicros >= ((int64_t)1 << nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += nMicros;
+}
+
+CDBLatencyStats CDBLatencyHistogram::Get() const
+{
+    CDBLatencyStats stats;
+    stats.nCount = nCount;
+    stats.nTotalMicros = nTotalMicros;
+    for (int i = 0; i < CDBLatencyStats::BUCKETS; i++)
+        stats.vBuckets[i] = vBuckets[i];
+    return stats;
+}
+
 // Prefixed with null character to avoid collisions with other keys
 //
 // We must use a string constructor which specifies length so that we copy
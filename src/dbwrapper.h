@@ -12,6 +12,10 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -20,6 +24,78 @@
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
 
+/** LevelDB settings for one database. */
+struct CDBOptions
+{
+    //! Percentage of the cache size given to the block cache
+    int nBlockCachePercent;
+    //! Percentage of the cache size given to each write buffer (up to two may be held at once)
+    int nWriteBufferPercent;
+    //! Bits per key of the bloom filter, or 0 for none
+    int nBloomFilterBits;
+    //! Number of table files kept open
+    int nMaxOpenFiles;
+
+    CDBOptions() : nBlockCachePercent(50), nWriteBufferPercent(25), nBloomFilterBits(10), nMaxOpenFiles(64) {}
+};
+
+/** Operation latencies, counted in buckets of powers of two microseconds. */
+struct CDBLatencyStats
+{
+    static const int BUCKETS = 24;
+
+    uint64_t nCount;
+    uint64_t nTotalMicros;
+    //! vBuckets[i] counts operations that took less than 2^i us (and at
+    //! least 2^(i-1) us); the last bucket also holds all slower ones.
+    std::vector<uint64_t> vBuckets;
+
+    CDBLatencyStats() : nCount(0), nTotalMicros(0), vBuckets(BUCKETS) {}
+};
+
+/** Size and compaction work of one LevelDB level */
+struct CDBLevelStats
+{
+    int nLevel;
+    int nFiles;
+    double dSizeMB;
+    //! Time spent compacting into this level, and the data read and written doing so
+    double dCompactionSec;
+    double dCompactionReadMB;
+    double dCompactionWriteMB;
+};
+
+/** Statistics of a CDBWrapper since it was opened */
+struct CDBStats
+{
+    //! Lookups in the block cache that found, or did not find, the block
+    uint64_t nCacheHits;
+    uint64_t nCacheMisses;
+    //! Writes issued while level 0 had enough files for LevelDB to slow them down
+    uint64_t nStalledWrites;
+    uint64_t nMemoryUsage;
+    CDBLatencyStats reads;
+    CDBLatencyStats writes;
+    //! Levels that hold files or have seen compactions
+    std::vector<CDBLevelStats> vLevels;
+
+    std::string ToString() const;
+};
+
+/** Live latency counters behind CDBLatencyStats, safe to update from any thread. */
+class CDBLatencyHistogram
+{
+public:
+    CDBLatencyHistogram();
+    void Add(int64_t nMicros);
+    CDBLatencyStats Get() const;
+
+private:
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nTotalMicros;
+    std::atomic<uint64_t> vBuckets[CDBLatencyStats::BUCKETS];
+};
+
 class dbwrapper_error : public std::runtime_error
 {
 public:
@@ -56,11 +132,19 @@ private:
     CDataStream ssKey;
     CDataStream ssValue;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -75,6 +159,14 @@ public:
         leveldb::Slice slValue(ssValue.data(), ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
         ssKey.clear();
         ssValue.clear();
     }
@@ -87,8 +179,16 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
         ssKey.clear();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -190,6 +290,16 @@ private:
 
     std::vector<unsigned char> CreateObfuscateKey() const;
 
+    //! Block cache lookups, counted by the cache wrapper installed in options
+    std::atomic<uint64_t> nCacheHits;
+    std::atomic<uint64_t> nCacheMisses;
+    std::atomic<uint64_t> nStalledWrites;
+    mutable CDBLatencyHistogram histReads;
+    CDBLatencyHistogram histWrites;
+
+    //! Look up a serialized key, returning false if it is not found
+    bool ReadRaw(const leveldb::Slice& slKey, std::string& strValue) const;
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
@@ -198,8 +308,9 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] dbOptions   How nCacheSize is split up, and other LevelDB settings.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBOptions& dbOptions = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -211,13 +322,8 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
+        if (!ReadRaw(slKey, strValue))
+            return false;
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue.Xor(obfuscate_key);
@@ -245,14 +351,7 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
-        return true;
+        return ReadRaw(slKey, strValue);
     }
 
     template <typename K>
@@ -286,6 +385,25 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    //! Collect our counters and LevelDB's own statistics
+    void GetStats(CDBStats& stats) const;
+
+    /**
+     * Compact the underlying storage for the key range [key_begin, key_end].
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
+        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -6,6 +6,9 @@
 #include "crypto/common.h"
 #include "crypto/hmac_sha512.h"
 #include "pubkey.h"
+#include "hash/yescrypt/yescrypt-hash.h"
+
+#include <new>
 
 
 inline uint32_t ROTL32(uint32_t x, int8_t r)
@@ -208,3 +211,69 @@ uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
     SIPROUND;
     return v0 ^ v1 ^ v2 ^ v3;
 }
+
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra)
+{
+    /* Specialized implementation for efficiency */
+    uint64_t d = val.GetUint64(0);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1 ^ d;
+
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(1);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(2);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(3);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = (((uint64_t)36) << 56) | extra;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+YescryptContext::YescryptContext(bool fHugePages)
+{
+    ctx = yescrypt_ctx_new(fHugePages);
+    if (!ctx)
+        throw std::bad_alloc();
+}
+
+YescryptContext::~YescryptContext()
+{
+    yescrypt_ctx_free(ctx);
+}
+
+// Scratch allocation is the only way yescrypt_kdf can fail for these parameters.
+void YescryptContext::Hash(const char* input, char* output)
+{
+    if (yescrypt_hash_ctx(ctx, input, output))
+        throw std::bad_alloc();
+}
+
+void YescryptContext::HashMany(const char* inputs, char* outputs, size_t n)
+{
+    if (yescrypt_hash_many_ctx(ctx, inputs, outputs, n))
+        throw std::bad_alloc();
+}
@@ -206,5 +206,35 @@ public:
  *      .Finalize()
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+
+struct yescrypt_ctx;
+
+/**
+ * Scratch memory for YescryptR16 proof-of-work hashing, reused across calls.
+ * Meant to be held by a thread that hashes repeatedly, and must not be used
+ * by two threads at once. The memory is freed when the context is destroyed.
+ */
+class YescryptContext
+{
+private:
+    yescrypt_ctx* ctx;
+
+    YescryptContext(const YescryptContext&);
+    YescryptContext& operator=(const YescryptContext&);
+
+public:
+    /**
+     * With fHugePages, the scratch memory is allocated right away and backed
+     * by transparent huge pages where the OS supports them.
+     */
+    explicit YescryptContext(bool fHugePages = false);
+    ~YescryptContext();
+
+    /** Hash an 80-byte block header into its 32-byte proof-of-work hash. */
+    void Hash(const char* input, char* output);
+    /** Hash n consecutive 80-byte block headers into n consecutive 32-byte hashes. */
+    void HashMany(const char* inputs, char* outputs, size_t n);
+};
 
 #endif // BITCOIN_HASH_H
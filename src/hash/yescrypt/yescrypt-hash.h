@@ -0,0 +1,65 @@
+/*
+ * YescryptR16 (N = 4096, r = 16) entry points for the rest of the codebase.
+ */
+#ifndef _YESCRYPT_HASH_H_
+#define _YESCRYPT_HASH_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Scratch memory for YescryptR16, reused across calls.  A context must only
+ * be used by one thread at a time.
+ */
+typedef struct yescrypt_ctx yescrypt_ctx_t;
+
+/**
+ * yescrypt_ctx_new(hugepages):
+ * Allocate a context.  With hugepages set, the scratch region is allocated
+ * right away and backed by transparent huge pages where the OS supports
+ * them; otherwise it is allocated on first use.  Return NULL on error.
+ */
+yescrypt_ctx_t *yescrypt_ctx_new(int hugepages);
+
+/**
+ * yescrypt_ctx_free(ctx):
+ * Free a context and its scratch region.  ctx may be NULL.
+ */
+void yescrypt_ctx_free(yescrypt_ctx_t *ctx);
+
+/**
+ * yescrypt_hash_ctx(ctx, input, output):
+ * yescrypt_hash_many_ctx(ctx, inputs, outputs, n):
+ * As yescrypt_hash() and yescrypt_hash_many(), using the scratch region of
+ * ctx.  Return 0 on success; or -1 on error.
+ */
+int yescrypt_hash_ctx(yescrypt_ctx_t *ctx, const char *input, char *output);
+int yescrypt_hash_many_ctx(yescrypt_ctx_t *ctx,
+                           const char *inputs, char *outputs, size_t n);
+
+/**
+ * yescrypt_hash(input, output):
+ * Hash an 80-byte block header into a 32-byte PoW hash.  The scratch region
+ * is allocated and freed within the call; callers that hash repeatedly
+ * should hold a context instead.
+ */
+void yescrypt_hash(const char *input, char *output);
+
+/**
+ * yescrypt_hash_many(inputs, outputs, n):
+ * Hash n consecutive 80-byte block headers into n consecutive 32-byte PoW
+ * hashes, with the same results as n calls to yescrypt_hash().  The scratch
+ * region is allocated once for the whole batch.  On x86-64, headers are
+ * hashed two at a time by an interleaved kernel, with a scratch region twice
+ * the size of a single hash's.
+ */
+void yescrypt_hash_many(const char *inputs, char *outputs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_YESCRYPT_HASH_H_ */
@@ -0,0 +1,511 @@
+/*-
+ * Copyright 2014 Alexander Peslyak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-lane interleaved variant of the SIMD kernel, for batch hashing.
+ *
+ * A single instance keeps the core waiting on the multiply and S-box lookup
+ * chains of pwxform and on the reads of V_j.  Here two independent instances
+ * (lanes a and b) go through smix1 and smix2 in lockstep: every BlockMix
+ * step processes the same sub-block of both lanes, with their pwxform rounds
+ * interleaved, so that the CPU overlaps the two dependency chains.  Each lane
+ * has its own B, V, XY and S.
+ *
+ * Only the YescryptR16 case is implemented (YESCRYPT_RW | YESCRYPT_PWXFORM,
+ * p = 1, t = 0, no ROM), with results identical to yescrypt_kdf().  Must be
+ * included after yescrypt-simd_c.h, on x86-64 only (EXTRACT64).
+ */
+
+#define X2_LOAD4(l, in) \
+	X##l##0 = (in)[0]; \
+	X##l##1 = (in)[1]; \
+	X##l##2 = (in)[2]; \
+	X##l##3 = (in)[3];
+
+#define X2_XOR4(l, in) \
+	X##l##0 = _mm_xor_si128(X##l##0, (in)[0]); \
+	X##l##1 = _mm_xor_si128(X##l##1, (in)[1]); \
+	X##l##2 = _mm_xor_si128(X##l##2, (in)[2]); \
+	X##l##3 = _mm_xor_si128(X##l##3, (in)[3]);
+
+#define X2_XOR4_2(l, in1, in2) \
+	X##l##0 = _mm_xor_si128((in1)[0], (in2)[0]); \
+	X##l##1 = _mm_xor_si128((in1)[1], (in2)[1]); \
+	X##l##2 = _mm_xor_si128((in1)[2], (in2)[2]); \
+	X##l##3 = _mm_xor_si128((in1)[3], (in2)[3]);
+
+/* out <-- in \xor out, X <-- X \xor out */
+#define X2_XOR4_SAVE(l, in, out) \
+	{ \
+		__m128i Y; \
+		(out)[0] = Y = _mm_xor_si128((in)[0], (out)[0]); \
+		X##l##0 = _mm_xor_si128(X##l##0, Y); \
+		(out)[1] = Y = _mm_xor_si128((in)[1], (out)[1]); \
+		X##l##1 = _mm_xor_si128(X##l##1, Y); \
+		(out)[2] = Y = _mm_xor_si128((in)[2], (out)[2]); \
+		X##l##2 = _mm_xor_si128(X##l##2, Y); \
+		(out)[3] = Y = _mm_xor_si128((in)[3], (out)[3]); \
+		X##l##3 = _mm_xor_si128(X##l##3, Y); \
+	}
+
+#define X2_OUT(l, out) \
+	(out)[0] = X##l##0; \
+	(out)[1] = X##l##1; \
+	(out)[2] = X##l##2; \
+	(out)[3] = X##l##3;
+
+#define X2_PWXFORM_SIMD(l, k) \
+	{ \
+		uint64_t x = EXTRACT64(X##l##k) & S_MASK2; \
+		__m128i s0 = *(const __m128i *)(S0##l + (uint32_t)x); \
+		__m128i s1 = *(const __m128i *)(S1##l + (x >> 32)); \
+		X##l##k = _mm_mul_epu32(HI32(X##l##k), X##l##k); \
+		X##l##k = _mm_add_epi64(X##l##k, s0); \
+		X##l##k = _mm_xor_si128(X##l##k, s1); \
+	}
+
+#define X2_PWXFORM_ROUND \
+	X2_PWXFORM_SIMD(a, 0) X2_PWXFORM_SIMD(b, 0) \
+	X2_PWXFORM_SIMD(a, 1) X2_PWXFORM_SIMD(b, 1) \
+	X2_PWXFORM_SIMD(a, 2) X2_PWXFORM_SIMD(b, 2) \
+	X2_PWXFORM_SIMD(a, 3) X2_PWXFORM_SIMD(b, 3)
+
+#define X2_PWXFORM \
+	X2_PWXFORM_ROUND X2_PWXFORM_ROUND \
+	X2_PWXFORM_ROUND X2_PWXFORM_ROUND \
+	X2_PWXFORM_ROUND X2_PWXFORM_ROUND
+
+#define X2_ARX(out, in1, in2, s) \
+	{ \
+		__m128i T = _mm_add_epi32(in1, in2); \
+		out = _mm_xor_si128(out, _mm_slli_epi32(T, s)); \
+		out = _mm_xor_si128(out, _mm_srli_epi32(T, 32-s)); \
+	}
+
+#define X2_SALSA20_2ROUNDS(l) \
+	/* Operate on "columns" */ \
+	X2_ARX(X##l##1, X##l##0, X##l##3, 7) \
+	X2_ARX(X##l##2, X##l##1, X##l##0, 9) \
+	X2_ARX(X##l##3, X##l##2, X##l##1, 13) \
+	X2_ARX(X##l##0, X##l##3, X##l##2, 18) \
+\
+	/* Rearrange data */ \
+	X##l##1 = _mm_shuffle_epi32(X##l##1, 0x93); \
+	X##l##2 = _mm_shuffle_epi32(X##l##2, 0x4E); \
+	X##l##3 = _mm_shuffle_epi32(X##l##3, 0x39); \
+\
+	/* Operate on "rows" */ \
+	X2_ARX(X##l##3, X##l##0, X##l##1, 7) \
+	X2_ARX(X##l##2, X##l##3, X##l##0, 9) \
+	X2_ARX(X##l##1, X##l##2, X##l##3, 13) \
+	X2_ARX(X##l##0, X##l##1, X##l##2, 18) \
+\
+	/* Rearrange data */ \
+	X##l##1 = _mm_shuffle_epi32(X##l##1, 0x39); \
+	X##l##2 = _mm_shuffle_epi32(X##l##2, 0x4E); \
+	X##l##3 = _mm_shuffle_epi32(X##l##3, 0x93);
+
+#define X2_SALSA20_8_ADD(l, Y, out) \
+	(out)[0] = X##l##0 = _mm_add_epi32(X##l##0, Y##l##0); \
+	(out)[1] = X##l##1 = _mm_add_epi32(X##l##1, Y##l##1); \
+	(out)[2] = X##l##2 = _mm_add_epi32(X##l##2, Y##l##2); \
+	(out)[3] = X##l##3 = _mm_add_epi32(X##l##3, Y##l##3);
+
+/**
+ * Apply the salsa20/8 core to the blocks in (Xa0 ... Xa3) and (Xb0 ... Xb3).
+ */
+#define X2_SALSA20_8(outa, outb) \
+	{ \
+		__m128i Ya0 = Xa0, Ya1 = Xa1, Ya2 = Xa2, Ya3 = Xa3; \
+		__m128i Yb0 = Xb0, Yb1 = Xb1, Yb2 = Xb2, Yb3 = Xb3; \
+		X2_SALSA20_2ROUNDS(a) X2_SALSA20_2ROUNDS(b) \
+		X2_SALSA20_2ROUNDS(a) X2_SALSA20_2ROUNDS(b) \
+		X2_SALSA20_2ROUNDS(a) X2_SALSA20_2ROUNDS(b) \
+		X2_SALSA20_2ROUNDS(a) X2_SALSA20_2ROUNDS(b) \
+		X2_SALSA20_8_ADD(a, Y, outa) \
+		X2_SALSA20_8_ADD(b, Y, outb) \
+	}
+
+#define X2_DECLARE_S(l, S) \
+	const uint8_t * S0##l = (const uint8_t *)(S); \
+	const uint8_t * S1##l = (const uint8_t *)(S) + S_SIZE_ALL / 2;
+
+/**
+ * blockmix_x2(Bina, Bouta, Binb, Boutb, r, Sa, Sb):
+ * blockmix() with pwxform on both lanes.
+ */
+static void
+blockmix_x2(const salsa20_blk_t *restrict Bina, salsa20_blk_t *restrict Bouta,
+    const salsa20_blk_t *restrict Binb, salsa20_blk_t *restrict Boutb,
+    size_t r, const __m128i *restrict Sa, const __m128i *restrict Sb)
+{
+	X2_DECLARE_S(a, Sa)
+	X2_DECLARE_S(b, Sb)
+	__m128i Xa0, Xa1, Xa2, Xa3, Xb0, Xb1, Xb2, Xb3;
+	size_t i;
+
+	/* Convert 128-byte blocks to 64-byte blocks */
+	r = r * 2 - 1;
+
+	PREFETCH(&Bina[r], _MM_HINT_T0)
+	PREFETCH(&Binb[r], _MM_HINT_T0)
+	for (i = 0; i < r; i++) {
+		PREFETCH(&Bina[i], _MM_HINT_T0)
+		PREFETCH(&Binb[i], _MM_HINT_T0)
+	}
+
+	/* X <-- B_{r1 - 1} */
+	X2_LOAD4(a, Bina[r].q)
+	X2_LOAD4(b, Binb[r].q)
+
+	/* for i = 0 to r1 - 1 do */
+	for (i = 0; i < r; i++) {
+		/* X <-- H'(X \xor B_i) */
+		X2_XOR4(a, Bina[i].q)
+		X2_XOR4(b, Binb[i].q)
+		X2_PWXFORM
+		/* B'_i <-- X */
+		X2_OUT(a, Bouta[i].q)
+		X2_OUT(b, Boutb[i].q)
+	}
+
+	/* Last iteration of the loop above */
+	X2_XOR4(a, Bina[i].q)
+	X2_XOR4(b, Binb[i].q)
+	X2_PWXFORM
+
+	/* B'_i <-- H(B'_i) */
+	X2_SALSA20_8(Bouta[i].q, Boutb[i].q)
+}
+
+/**
+ * blockmix_xor_x2(Bin1a, Bin2a, Bouta, Bin1b, Bin2b, Boutb, r, Sa, Sb, j):
+ * blockmix_xor() with pwxform and without ROM on both lanes, returning the
+ * Integerify() values of the lanes in j[0] and j[1].
+ */
+static void
+blockmix_xor_x2(const salsa20_blk_t *restrict Bin1a,
+    const salsa20_blk_t *restrict Bin2a, salsa20_blk_t *restrict Bouta,
+    const salsa20_blk_t *restrict Bin1b,
+    const salsa20_blk_t *restrict Bin2b, salsa20_blk_t *restrict Boutb,
+    size_t r, const __m128i *restrict Sa, const __m128i *restrict Sb,
+    uint32_t j[2])
+{
+	X2_DECLARE_S(a, Sa)
+	X2_DECLARE_S(b, Sb)
+	__m128i Xa0, Xa1, Xa2, Xa3, Xb0, Xb1, Xb2, Xb3;
+	size_t i;
+
+	/* Convert 128-byte blocks to 64-byte blocks */
+	r = r * 2 - 1;
+
+	PREFETCH(&Bin2a[r], _MM_HINT_T0)
+	PREFETCH(&Bin2b[r], _MM_HINT_T0)
+	PREFETCH(&Bin1a[r], _MM_HINT_T0)
+	PREFETCH(&Bin1b[r], _MM_HINT_T0)
+	for (i = 0; i < r; i++) {
+		PREFETCH(&Bin2a[i], _MM_HINT_T0)
+		PREFETCH(&Bin2b[i], _MM_HINT_T0)
+		PREFETCH(&Bin1a[i], _MM_HINT_T0)
+		PREFETCH(&Bin1b[i], _MM_HINT_T0)
+	}
+
+	/* X <-- B_{r1 - 1} */
+	X2_XOR4_2(a, Bin1a[r].q, Bin2a[r].q)
+	X2_XOR4_2(b, Bin1b[r].q, Bin2b[r].q)
+
+	/* for i = 0 to r1 - 1 do */
+	for (i = 0; i < r; i++) {
+		/* X <-- H'(X \xor B_i) */
+		X2_XOR4(a, Bin1a[i].q)
+		X2_XOR4(a, Bin2a[i].q)
+		X2_XOR4(b, Bin1b[i].q)
+		X2_XOR4(b, Bin2b[i].q)
+		X2_PWXFORM
+		/* B'_i <-- X */
+		X2_OUT(a, Bouta[i].q)
+		X2_OUT(b, Boutb[i].q)
+	}
+
+	/* Last iteration of the loop above */
+	X2_XOR4(a, Bin1a[i].q)
+	X2_XOR4(a, Bin2a[i].q)
+	X2_XOR4(b, Bin1b[i].q)
+	X2_XOR4(b, Bin2b[i].q)
+	X2_PWXFORM
+
+	/* B'_i <-- H(B'_i) */
+	X2_SALSA20_8(Bouta[i].q, Boutb[i].q)
+
+	j[0] = _mm_cvtsi128_si32(Xa0);
+	j[1] = _mm_cvtsi128_si32(Xb0);
+}
+
+/**
+ * blockmix_xor_save_x2(Bin1a, Bin2a, Bouta, Bin1b, Bin2b, Boutb, r, Sa, Sb,
+ *     j):
+ * blockmix_xor_save() with pwxform on both lanes, returning the Integerify()
+ * values of the lanes in j[0] and j[1].
+ */
+static void
+blockmix_xor_save_x2(const salsa20_blk_t *restrict Bin1a,
+    salsa20_blk_t *restrict Bin2a, salsa20_blk_t *restrict Bouta,
+    const salsa20_blk_t *restrict Bin1b,
+    salsa20_blk_t *restrict Bin2b, salsa20_blk_t *restrict Boutb,
+    size_t r, const __m128i *restrict Sa, const __m128i *restrict Sb,
+    uint32_t j[2])
+{
+	X2_DECLARE_S(a, Sa)
+	X2_DECLARE_S(b, Sb)
+	__m128i Xa0, Xa1, Xa2, Xa3, Xb0, Xb1, Xb2, Xb3;
+	size_t i;
+
+	/* Convert 128-byte blocks to 64-byte blocks */
+	r = r * 2 - 1;
+
+	PREFETCH(&Bin2a[r], _MM_HINT_T0)
+	PREFETCH(&Bin2b[r], _MM_HINT_T0)
+	PREFETCH(&Bin1a[r], _MM_HINT_T0)
+	PREFETCH(&Bin1b[r], _MM_HINT_T0)
+	for (i = 0; i < r; i++) {
+		PREFETCH(&Bin2a[i], _MM_HINT_T0)
+		PREFETCH(&Bin2b[i], _MM_HINT_T0)
+		PREFETCH(&Bin1a[i], _MM_HINT_T0)
+		PREFETCH(&Bin1b[i], _MM_HINT_T0)
+	}
+
+	/* X <-- B_{r1 - 1} */
+	X2_XOR4_2(a, Bin1a[r].q, Bin2a[r].q)
+	X2_XOR4_2(b, Bin1b[r].q, Bin2b[r].q)
+
+	/* for i = 0 to r1 - 1 do */
+	for (i = 0; i < r; i++) {
+		/* X <-- H'(X \xor B_i) */
+		X2_XOR4_SAVE(a, Bin1a[i].q, Bin2a[i].q)
+		X2_XOR4_SAVE(b, Bin1b[i].q, Bin2b[i].q)
+		X2_PWXFORM
+		/* B'_i <-- X */
+		X2_OUT(a, Bouta[i].q)
+		X2_OUT(b, Boutb[i].q)
+	}
+
+	/* Last iteration of the loop above */
+	X2_XOR4_SAVE(a, Bin1a[i].q, Bin2a[i].q)
+	X2_XOR4_SAVE(b, Bin1b[i].q, Bin2b[i].q)
+	X2_PWXFORM
+
+	/* B'_i <-- H(B'_i) */
+	X2_SALSA20_8(Bouta[i].q, Boutb[i].q)
+
+	j[0] = _mm_cvtsi128_si32(Xa0);
+	j[1] = _mm_cvtsi128_si32(Xb0);
+}
+
+#undef X2_LOAD4
+#undef X2_XOR4
+#undef X2_XOR4_2
+#undef X2_XOR4_SAVE
+#undef X2_OUT
+#undef X2_PWXFORM_SIMD
+#undef X2_PWXFORM_ROUND
+#undef X2_PWXFORM
+#undef X2_ARX
+#undef X2_SALSA20_2ROUNDS
+#undef X2_SALSA20_8_ADD
+#undef X2_SALSA20_8
+#undef X2_DECLARE_S
+
+/* One lane's share of the scratch region: B, V, XY and S, as yescrypt_kdf() lays them out */
+typedef struct {
+	uint8_t * B;
+	salsa20_blk_t * V;
+	salsa20_blk_t * XY;
+	salsa20_blk_t * S;
+} yescrypt_lane_t;
+
+static void
+lane_decode(salsa20_blk_t * X, const uint8_t * B, size_t r)
+{
+	size_t k, i;
+
+	for (k = 0; k < 2 * r; k++) {
+		for (i = 0; i < 16; i++) {
+			X[k].w[i] = le32dec(&B[(k * 16 + (i * 5 % 16)) * 4]);
+		}
+	}
+}
+
+static void
+lane_encode(uint8_t * B, const salsa20_blk_t * X, size_t r)
+{
+	size_t k, i;
+
+	for (k = 0; k < 2 * r; k++) {
+		for (i = 0; i < 16; i++) {
+			le32enc(&B[(k * 16 + (i * 5 % 16)) * 4], X[k].w[i]);
+		}
+	}
+}
+
+/**
+ * smix1_x2(a, b, r, N):
+ * smix1() for YESCRYPT_RW with pwxform and without ROM, on both lanes.
+ */
+static void
+smix1_x2(const yescrypt_lane_t * a, const yescrypt_lane_t * b,
+    size_t r, uint32_t N)
+{
+	const __m128i * Sa = (const __m128i *)a->S, * Sb = (const __m128i *)b->S;
+	size_t s = 2 * r;
+	salsa20_blk_t * Xa = a->V, * Xb = b->V, * Ya, * Yb, * V_na, * V_nb;
+	uint32_t i, n, j[2];
+
+	/* 1: X <-- B */
+	/* 3: V_i <-- X */
+	lane_decode(Xa, a->B, r);
+	lane_decode(Xb, b->B, r);
+
+	/* 4: X <-- H(X) */
+	/* 3: V_i <-- X */
+	Ya = &a->V[s];
+	Yb = &b->V[s];
+	blockmix_x2(Xa, Ya, Xb, Yb, r, Sa, Sb);
+
+	/* 4: X <-- H(X) */
+	/* 3: V_i <-- X */
+	Xa = &a->V[2 * s];
+	Xb = &b->V[2 * s];
+	blockmix_x2(Ya, Xa, Yb, Xb, r, Sa, Sb);
+	j[0] = integerify(Xa, r);
+	j[1] = integerify(Xb, r);
+
+	for (n = 2; n < N; n <<= 1) {
+		uint32_t m = (n < N / 2) ? n : (N - 1 - n);
+
+		V_na = &a->V[n * s];
+		V_nb = &b->V[n * s];
+
+		/* 2: for i = 0 to N - 1 do */
+		for (i = 1; i < m; i += 2) {
+			Ya = &V_na[i * s];
+			Yb = &V_nb[i * s];
+
+			/* j <-- Wrap(Integerify(X), i) */
+			j[0] = (j[0] & (n - 1)) + i - 1;
+			j[1] = (j[1] & (n - 1)) + i - 1;
+
+			/* X <-- X \xor V_j */
+			/* 4: X <-- H(X) */
+			/* 3: V_i <-- X */
+			blockmix_xor_x2(Xa, &a->V[j[0] * s], Ya,
+			    Xb, &b->V[j[1] * s], Yb, r, Sa, Sb, j);
+
+			/* j <-- Wrap(Integerify(X), i) */
+			j[0] = (j[0] & (n - 1)) + i;
+			j[1] = (j[1] & (n - 1)) + i;
+
+			/* X <-- X \xor V_j */
+			/* 4: X <-- H(X) */
+			/* 3: V_i <-- X */
+			Xa = &V_na[(i + 1) * s];
+			Xb = &V_nb[(i + 1) * s];
+			blockmix_xor_x2(Ya, &a->V[j[0] * s], Xa,
+			    Yb, &b->V[j[1] * s], Xb, r, Sa, Sb, j);
+		}
+	}
+
+	n >>= 1;
+
+	/* j <-- Wrap(Integerify(X), i) */
+	j[0] = (j[0] & (n - 1)) + N - 2 - n;
+	j[1] = (j[1] & (n - 1)) + N - 2 - n;
+
+	/* X <-- X \xor V_j */
+	/* 4: X <-- H(X) */
+	/* 3: V_i <-- X */
+	Ya = &a->V[(N - 1) * s];
+	Yb = &b->V[(N - 1) * s];
+	blockmix_xor_x2(Xa, &a->V[j[0] * s], Ya,
+	    Xb, &b->V[j[1] * s], Yb, r, Sa, Sb, j);
+
+	/* j <-- Wrap(Integerify(X), i) */
+	j[0] = (j[0] & (n - 1)) + N - 1 - n;
+	j[1] = (j[1] & (n - 1)) + N - 1 - n;
+
+	/* X <-- X \xor V_j */
+	/* 4: X <-- H(X) */
+	Xa = a->XY;
+	Xb = b->XY;
+	blockmix_xor_x2(Ya, &a->V[j[0] * s], Xa,
+	    Yb, &b->V[j[1] * s], Xb, r, Sa, Sb, j);
+
+	/* B' <-- X */
+	lane_encode(a->B, Xa, r);
+	lane_encode(b->B, Xb, r);
+}
+
+/**
+ * smix2_x2(a, b, r, N, Nloop):
+ * smix2() for YESCRYPT_RW with pwxform and without ROM, on both lanes.  The
+ * value Nloop must be even and non-zero.
+ */
+static void
+smix2_x2(const yescrypt_lane_t * a, const yescrypt_lane_t * b,
+    size_t r, uint32_t N, uint64_t Nloop)
+{
+	const __m128i * Sa = (const __m128i *)a->S, * Sb = (const __m128i *)b->S;
+	size_t s = 2 * r;
+	salsa20_blk_t * Xa = a->XY, * Ya = &a->XY[s];
+	salsa20_blk_t * Xb = b->XY, * Yb = &b->XY[s];
+	uint64_t i;
+	uint32_t j[2];
+
+	/* X <-- B' */
+	lane_decode(Xa, a->B, r);
+	lane_decode(Xb, b->B, r);
+
+	/* 7: j <-- Integerify(X) mod N */
+	j[0] = integerify(Xa, r) & (N - 1);
+	j[1] = integerify(Xb, r) & (N - 1);
+
+	/* 6: for i = 0 to N - 1 do */
+	i = Nloop / 2;
+	do {
+		/* 8: X <-- H(X \xor V_j) */
+		/* V_j <-- Xprev \xor V_j */
+		/* 7: j <-- Integerify(X) mod N */
+		blockmix_xor_save_x2(Xa, &a->V[j[0] * s], Ya,
+		    Xb, &b->V[j[1] * s], Yb, r, Sa, Sb, j);
+		j[0] &= N - 1;
+		j[1] &= N - 1;
+
+		/* 8: X <-- H(X \xor V_j) */
+		/* V_j <-- Xprev \xor V_j */
+		/* 7: j <-- Integerify(X) mod N */
+		blockmix_xor_save_x2(Ya, &a->V[j[0] * s], Xa,
+		    Yb, &b->V[j[1] * s], Xb, r, Sa, Sb, j);
+		j[0] &= N - 1;
+		j[1] &= N - 1;
+	} while (--i);
+
+	/* 10: B' <-- X */
+	lane_encode(a->B, Xa, r);
+	lane_encode(b->B, Xb, r);
+}
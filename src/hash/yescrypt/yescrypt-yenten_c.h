@@ -0,0 +1,161 @@
+/*-
+ * Copyright 2014 Alexander Peslyak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * YescryptR16 parameters and batch hashing on top of the selected kernel.
+ * Must be included after the kernel.
+ */
+
+#define YESCRYPT_N 4096
+#define YESCRYPT_R 16
+#define YESCRYPT_P 1
+#define YESCRYPT_T 0
+#define YESCRYPT_FLAGS (YESCRYPT_RW | YESCRYPT_PWXFORM)
+
+#define YESCRYPT_INPUT_SIZE 80
+#define YESCRYPT_OUTPUT_SIZE 32
+
+/* Scratch memory needed by yescrypt_kdf() for one YescryptR16 instance. */
+#define YESCRYPT_LANE_SIZE \
+    ((size_t)128 * YESCRYPT_R * YESCRYPT_P + \
+     (size_t)128 * YESCRYPT_R * YESCRYPT_N + \
+     (size_t)256 * YESCRYPT_R + \
+     (size_t)S_N * S_SIZE1 * S_SIMD * 8)
+
+/*
+ * Batches are hashed YESCRYPT_LANES inputs at a time, by the interleaved
+ * kernel where the SIMD kernel provides one.
+ */
+#if defined(__SSE2__) && defined(__x86_64__)
+#include "yescrypt-simd-x2_c.h"
+#define YESCRYPT_LANES 2
+#else
+#define YESCRYPT_LANES 1
+#endif
+
+/* Scratch memory needed to hash a batch, with either kernel. */
+#define YESCRYPT_LOCAL_SIZE (YESCRYPT_LANES * YESCRYPT_LANE_SIZE)
+
+#if YESCRYPT_LANES == 2
+/*
+ * Hash in[0 .. 79] and in[80 .. 159] into out[0 .. 31] and out[32 .. 63]
+ * exactly as yescrypt_kdf() does with the YescryptR16 parameters, running
+ * the memory-hard part of both through the interleaved kernel.  region must
+ * hold 2 * YESCRYPT_LANE_SIZE bytes, aligned to 64 bytes.
+ */
+static void yescrypt_yenten_x2(const yescrypt_shared_t *shared,
+                               uint8_t *region, const uint8_t *in, uint8_t *out)
+{
+    /* As computed by smix() for t = 0 and p = 1; even, so all of it is RW. */
+    const uint64_t Nloop = ((YESCRYPT_N + 2) / 3) & ~(uint64_t)1;
+    const size_t B_size = (size_t)128 * YESCRYPT_R;
+    yescrypt_lane_t lanes[2];
+    uint8_t sha256[2][32];
+    int l;
+
+    for (l = 0; l < 2; l++) {
+        const uint8_t *input = in + l * YESCRYPT_INPUT_SIZE;
+        yescrypt_lane_t *lane = &lanes[l];
+        SHA256_CTX ctx;
+
+        lane->B = region + l * YESCRYPT_LANE_SIZE;
+        lane->V = (salsa20_blk_t *)(lane->B + B_size);
+        lane->XY = lane->V + 2 * YESCRYPT_R * YESCRYPT_N;
+        lane->S = lane->XY + 4 * YESCRYPT_R;
+
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, input, YESCRYPT_INPUT_SIZE);
+        SHA256_Final(sha256[l], &ctx);
+
+        /* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+        PBKDF2_SHA256(sha256[l], sizeof(sha256[l]), input, YESCRYPT_INPUT_SIZE,
+                      1, lane->B, B_size);
+        memcpy(sha256[l], lane->B, sizeof(sha256[l]));
+
+        /* Fill the S-boxes; cheap next to the rest, so done lane by lane. */
+        smix1(lane->B, 1, S_SIZE_ALL / 128, YESCRYPT_FLAGS & ~YESCRYPT_PWXFORM,
+              lane->S, 0, shared, lane->XY, NULL);
+    }
+
+    smix1_x2(&lanes[0], &lanes[1], YESCRYPT_R, YESCRYPT_N);
+    smix2_x2(&lanes[0], &lanes[1], YESCRYPT_R, YESCRYPT_N, Nloop);
+
+    for (l = 0; l < 2; l++) {
+        uint8_t *output = out + l * YESCRYPT_OUTPUT_SIZE;
+        HMAC_SHA256_CTX hctx;
+        SHA256_CTX ctx;
+
+        /* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+        PBKDF2_SHA256(sha256[l], sizeof(sha256[l]), lanes[l].B, B_size,
+                      1, output, YESCRYPT_OUTPUT_SIZE);
+
+        /* Compute ClientKey */
+        HMAC_SHA256_Init(&hctx, output, YESCRYPT_OUTPUT_SIZE);
+        HMAC_SHA256_Update(&hctx, "Client Key", 10);
+        HMAC_SHA256_Final(sha256[l], &hctx);
+        /* Compute StoredKey */
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, sha256[l], sizeof(sha256[l]));
+        SHA256_Final(output, &ctx);
+    }
+}
+#endif
+
+/*
+ * Hash n consecutive 80-byte inputs, each used as both password and salt,
+ * into n consecutive 32-byte outputs, using (and if needed growing) the
+ * caller's scratch region.
+ */
+static int yescrypt_yenten_many(yescrypt_local_t *local,
+                                const uint8_t *in, uint8_t *out, size_t n)
+{
+    yescrypt_shared_t shared;
+    size_t i = 0;
+
+    /* No ROM, so this is just the empty shared region and never fails. */
+    if (yescrypt_init_shared(&shared, NULL, 0,
+                             0, 0, 0, YESCRYPT_SHARED_DEFAULTS, 0, NULL, 0))
+        return -1;
+#if YESCRYPT_LANES == 2
+    if (n >= 2) {
+        if (local->aligned_size < YESCRYPT_LOCAL_SIZE) {
+            if (free_region(local))
+                return -1;
+            if (!alloc_region(local, YESCRYPT_LOCAL_SIZE))
+                return -1;
+        }
+        for (; i + 2 <= n; i += 2)
+            yescrypt_yenten_x2(&shared, local->aligned,
+                               in + i * YESCRYPT_INPUT_SIZE,
+                               out + i * YESCRYPT_OUTPUT_SIZE);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint8_t *input = in + i * YESCRYPT_INPUT_SIZE;
+        if (yescrypt_kdf(&shared, local, input, YESCRYPT_INPUT_SIZE,
+                         input, YESCRYPT_INPUT_SIZE,
+                         YESCRYPT_N, YESCRYPT_R, YESCRYPT_P, YESCRYPT_T,
+                         YESCRYPT_FLAGS, out + i * YESCRYPT_OUTPUT_SIZE,
+                         YESCRYPT_OUTPUT_SIZE))
+            return -1;
+    }
+
+    return 0;
+}
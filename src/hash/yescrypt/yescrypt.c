@@ -17,92 +17,106 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include "yescrypt.h"
+#include "yescrypt-hash.h"
 #include "sha256_c.h"
 #include "yescrypt-best_c.h"
+#include "yescrypt-yenten_c.h"
 
-#define YESCRYPT_N 4096
-#define YESCRYPT_R 16
-#define YESCRYPT_P 1
-#define YESCRYPT_T 0
-#define YESCRYPT_FLAGS (YESCRYPT_RW | YESCRYPT_PWXFORM)
+/*
+ * Only for madvise().  Included after the kernel, so that its regions keep
+ * being allocated with malloc() rather than mmap().
+ */
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
-#ifdef __clang__
+#define YESCRYPT_HUGEPAGE_SIZE (2 * 1024 * 1024)
 
-static int yescrypt_yenten(const uint8_t *passwd, size_t passwdlen,
-                            const uint8_t *salt, size_t saltlen,
-                            uint8_t *buf, size_t buflen)
-{
-    yescrypt_shared_t shared;
+struct yescrypt_ctx {
     yescrypt_local_t local;
-    int retval;
-    
-    if (yescrypt_init_shared(&shared, NULL, 0,
-                             0, 0, 0, YESCRYPT_SHARED_DEFAULTS, 0, NULL, 0))
-        return -1;
-    if (yescrypt_init_local(&local)) {
-        yescrypt_free_shared(&shared);
-        return -1;
-    }
-    retval = yescrypt_kdf(&shared, &local, passwd, passwdlen, salt, saltlen,
-                          YESCRYPT_N, YESCRYPT_R, YESCRYPT_P, YESCRYPT_T,
-                          YESCRYPT_FLAGS, buf, buflen);
-    if (yescrypt_free_local(&local)) {
-        yescrypt_free_shared(&shared);
-        return -1;
-    }
-    if (yescrypt_free_shared(&shared))
+};
+
+/*
+ * Allocate the whole scratch region up front, aligned to and advised as
+ * transparent huge pages.  It is sized for a batch, so neither kernel ever
+ * reallocates it.  The region stays malloc()-backed, so that
+ * free_region() can release it like one allocated by the kernel itself.
+ */
+static int alloc_hugepage_region(yescrypt_local_t *local)
+{
+    const size_t size = YESCRYPT_LOCAL_SIZE;
+    uint8_t *base, *aligned;
+
+    if ((base = malloc(size + YESCRYPT_HUGEPAGE_SIZE - 1)) == NULL)
         return -1;
-    
-    return retval;
+    aligned = base + YESCRYPT_HUGEPAGE_SIZE - 1;
+    aligned -= (uintptr_t)aligned & (YESCRYPT_HUGEPAGE_SIZE - 1);
+#ifdef MADV_HUGEPAGE
+    /* Only a hint; ordinary pages are used where huge pages are not. */
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    local->base = base;
+    local->aligned = aligned;
+    local->base_size = size + YESCRYPT_HUGEPAGE_SIZE - 1;
+    local->aligned_size = size;
+    return 0;
 }
 
-#else
+static int yescrypt_hash_many_local(yescrypt_local_t *local,
+                                    const char *inputs, char *outputs, size_t n)
+{
+    return yescrypt_yenten_many(local, (const uint8_t *) inputs,
+                                (uint8_t *) outputs, n);
+}
 
-static int yescrypt_yenten(const uint8_t *passwd, size_t passwdlen,
-                            const uint8_t *salt, size_t saltlen,
-                            uint8_t *buf, size_t buflen)
+yescrypt_ctx_t *yescrypt_ctx_new(int hugepages)
 {
-    static __thread int initialized = 0;
-    static __thread yescrypt_shared_t shared;
-    static __thread yescrypt_local_t local;
-    int retval;
-    if (!initialized) {
-        /* "shared" could in fact be shared, but it's simpler to keep it private
-         * along with "local".  It's dummy and tiny anyway. */
-        if (yescrypt_init_shared(&shared, NULL, 0,
-                                 0, 0, 0, YESCRYPT_SHARED_DEFAULTS, 0, NULL, 0))
-            return -1;
-        if (yescrypt_init_local(&local)) {
-            yescrypt_free_shared(&shared);
-            return -1;
-        }
-        initialized = 1;
-    }
-    retval = yescrypt_kdf(&shared, &local, passwd, passwdlen, salt, saltlen,
-                          YESCRYPT_N, YESCRYPT_R, YESCRYPT_P, YESCRYPT_T,
-                          YESCRYPT_FLAGS, buf, buflen);
-#if 0
-    if (yescrypt_free_local(&local)) {
-        yescrypt_free_shared(&shared);
-        return -1;
-    }
-    if (yescrypt_free_shared(&shared))
-        return -1;
-    initialized = 0;
-#endif
-    if (retval < 0) {
-        yescrypt_free_local(&local);
-        yescrypt_free_shared(&shared);
+    yescrypt_ctx_t *ctx;
+
+    if ((ctx = malloc(sizeof(*ctx))) == NULL)
+        return NULL;
+    yescrypt_init_local(&ctx->local);
+    if (hugepages && alloc_hugepage_region(&ctx->local)) {
+        free(ctx);
+        return NULL;
     }
-    return retval;
+    return ctx;
 }
 
-#endif
+void yescrypt_ctx_free(yescrypt_ctx_t *ctx)
+{
+    if (!ctx)
+        return;
+    yescrypt_free_local(&ctx->local);
+    free(ctx);
+}
+
+int yescrypt_hash_ctx(yescrypt_ctx_t *ctx, const char *input, char *output)
+{
+    return yescrypt_hash_many_local(&ctx->local, input, output, 1);
+}
+
+int yescrypt_hash_many_ctx(yescrypt_ctx_t *ctx,
+                           const char *inputs, char *outputs, size_t n)
+{
+    return yescrypt_hash_many_local(&ctx->local, inputs, outputs, n);
+}
 
 void yescrypt_hash(const char *input, char *output)
 {
-    yescrypt_yenten((const uint8_t *) input, 80,
-                     (const uint8_t *) input, 80,
-                     (uint8_t *) output, 32);
+    yescrypt_hash_many(input, output, 1);
+}
+
+void yescrypt_hash_many(const char *inputs, char *outputs, size_t n)
+{
+    yescrypt_local_t local;
+
+    yescrypt_init_local(&local);
+    yescrypt_hash_many_local(&local, inputs, outputs, n);
+    yescrypt_free_local(&local);
 }
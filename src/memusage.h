@@ -6,6 +6,7 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "support/allocators/pool.h"
 
 #include <stdlib.h>
 
@@ -167,6 +168,19 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+// A map whose nodes come from a pool uses all of the pool's chunks, whether
+// or not their nodes are in use.
+template<typename X, typename Y, typename Z, typename E, typename T, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, PoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> >& m)
+{
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> Resource;
+    const Resource& resource = m.get_allocator().Resource();
+    // The resource and its shared_ptr counter come from one make_shared allocation.
+    return MallocUsage(sizeof(Resource) + sizeof(stl_shared_counter)) +
+        MallocUsage(resource.ChunkSizeBytes()) * resource.NumAllocatedChunks() +
+        MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
@@ -27,6 +27,7 @@
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -47,6 +48,8 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 uint64_t nLastBlockWeight = 0;
 
+std::unique_ptr<BlockTemplateCache> g_blocktemplatecache;
+
 class ScoreCompare
 {
 public:
@@ -73,6 +76,62 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
     return nNewTime - nOldTime;
 }
 
+BlockTemplateCache::BlockTemplateCache(CTxMemPool& poolIn) :
+    pool(poolIn), fValid(false), pindexPrev(NULL), fIncludeWitness(false), nBlockMaxWeight(0), nBlockMaxSize(0)
+{
+    pool.NotifyEntryAdded.connect(boost::bind(&BlockTemplateCache::TransactionAddedToMempool, this, _1));
+    pool.NotifyEntryRemoved.connect(boost::bind(&BlockTemplateCache::TransactionRemovedFromMempool, this, _1, _2));
+    pool.NotifyEntryPrioritised.connect(boost::bind(&BlockTemplateCache::TransactionPrioritised, this, _1));
+}
+
+BlockTemplateCache::~BlockTemplateCache()
+{
+    pool.NotifyEntryAdded.disconnect(boost::bind(&BlockTemplateCache::TransactionAddedToMempool, this, _1));
+    pool.NotifyEntryRemoved.disconnect(boost::bind(&BlockTemplateCache::TransactionRemovedFromMempool, this, _1, _2));
+    pool.NotifyEntryPrioritised.disconnect(boost::bind(&BlockTemplateCache::TransactionPrioritised, this, _1));
+}
+
+void BlockTemplateCache::Invalidate()
+{
+    LOCK(cs);
+    fValid = false;
+    pindexPrev = NULL;
+    vSelected.clear();
+    vPendingAdded.clear();
+}
+
+void BlockTemplateCache::TransactionAddedToMempool(CTransactionRef tx)
+{
+    LOCK(cs);
+    if (!fValid)
+        return;
+    if (vPendingAdded.size() >= MAX_TEMPLATE_PENDING_TXS) {
+        // No template has been asked for in a long while; catching up would
+        // cost about as much as starting over.
+        Invalidate();
+        return;
+    }
+    vPendingAdded.push_back(tx->GetHash());
+}
+
+void BlockTemplateCache::TransactionRemovedFromMempool(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    // These only happen when the tip changes, which the selection does not
+    // survive. Other removals are noticed when the selection is next checked
+    // against the mempool.
+    if (reason == MemPoolRemovalReason::BLOCK || reason == MemPoolRemovalReason::CONFLICT ||
+            reason == MemPoolRemovalReason::REORG) {
+        Invalidate();
+    }
+}
+
+void BlockTemplateCache::TransactionPrioritised(CTransactionRef tx)
+{
+    // A fee delta changes the package feerates of the transaction and of its
+    // ancestors and descendants, selected or not, so their order is redone.
+    Invalidate();
+}
+
 BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
     : chainparams(_chainparams)
 {
@@ -108,6 +167,8 @@ BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SERIALIZED_SIZE-1000), nBlockMaxSize));
     // Whether we need to account for byte usage (in addition to weight usage)
     fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000);
+
+    fTestBlockValidity = GetBoolArg("-checkblocktemplates", DEFAULT_CHECK_BLOCK_TEMPLATES);
 }
 
 void BlockAssembler::resetBlock()
@@ -123,6 +184,7 @@ void BlockAssembler::resetBlock()
     // These counters do not include coinbase tx
     nBlockTx = 0;
     nFees = 0;
+    minPackageFeeRate = CFeeRate(MAX_MONEY);
 
     lastFewTxs = 0;
     blockFinished = false;
@@ -145,71 +207,95 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
-    LOCK2(cs_main, mempool.cs);
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    nHeight = pindexPrev->nHeight + 1;
-
-    pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (chainparams.MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
-
-    pblock->nTime = GetAdjustedTime();
-    const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-
-    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                       ? nMedianTimePast
-                       : pblock->GetBlockTime();
-
-    // Decide whether to include witness transactions
-    // This is only needed in case the witness softfork activation is reverted
-    // (which would require a very deep reorganization) or when
-    // -promiscuousmempoolflags is used.
-    // TODO: replace this with a call to main to assess validity of a mempool
-    // transaction (which in most cases can be a no-op).
-    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
-
-    addPriorityTxs();
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
-
-    int64_t nTime1 = GetTimeMicros();
-
-    nLastBlockTx = nBlockTx;
-    nLastBlockSize = nBlockSize;
-    nLastBlockWeight = nBlockWeight;
-
-    // Create coinbase transaction.
-    CMutableTransaction coinbaseTx;
-    coinbaseTx.vin.resize(1);
-    coinbaseTx.vin[0].prevout.SetNull();
-    coinbaseTx.vout.resize(1);
-    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
-    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
-    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
-    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
-    pblocktemplate->vTxFees[0] = -nFees;
-
-    uint64_t nSerializeSize = GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
-    LogPrintf("CreateNewBlock(): total size: %u block weight: %u txs: %u fees: %ld sigops %d\n", nSerializeSize, GetBlockWeight(*pblock), nBlockTx, nFees, nBlockSigOpsCost);
-
-    // Fill in header
-    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-    pblock->nNonce         = 0;
-    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
-
+    BlockTemplateCache* pcache = NULL;
+    bool fIncremental = false;
+    int64_t nTime1;
     CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+    CBlockValiditySnapshot snapshot;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        nHeight = pindexPrev->nHeight + 1;
+
+        pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
+        // -regtest only: allow overriding block.nVersion with
+        // -blockversion=N to test forking scenarios
+        if (chainparams.MineBlocksOnDemand())
+            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+
+        pblock->nTime = GetAdjustedTime();
+        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+
+        nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                           ? nMedianTimePast
+                           : pblock->GetBlockTime();
+
+        // Decide whether to include witness transactions
+        // This is only needed in case the witness softfork activation is reverted
+        // (which would require a very deep reorganization) or when
+        // -promiscuousmempoolflags is used.
+        // TODO: replace this with a call to main to assess validity of a mempool
+        // transaction (which in most cases can be a no-op).
+        fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
+
+        // The cached selection is made by feerate only
+        if (GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE) == 0)
+            pcache = g_blocktemplatecache.get();
+        fIncremental = pcache && addCachedTxs(*pcache, pindexPrev, nPackagesSelected);
+        if (!fIncremental) {
+            addPriorityTxs();
+            addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+        }
+        if (pcache)
+            storeCachedTxs(*pcache, pindexPrev);
+
+        nTime1 = GetTimeMicros();
+
+        nLastBlockTx = nBlockTx;
+        nLastBlockSize = nBlockSize;
+        nLastBlockWeight = nBlockWeight;
+
+        // Create coinbase transaction.
+        CMutableTransaction coinbaseTx;
+        coinbaseTx.vin.resize(1);
+        coinbaseTx.vin[0].prevout.SetNull();
+        coinbaseTx.vout.resize(1);
+        coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+        coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+        coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+        pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
+        pblocktemplate->vTxFees[0] = -nFees;
+
+        uint64_t nSerializeSize = GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+        LogPrintf("CreateNewBlock(): total size: %u block weight: %u txs: %u fees: %ld sigops %d\n", nSerializeSize, GetBlockWeight(*pblock), nBlockTx, nFees, nBlockSigOpsCost);
+
+        // Fill in header
+        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+        pblock->nNonce         = 0;
+        pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
+
+        // Only what needs the chain and the mempool is done under the locks; the
+        // transactions are connected against a copy of their coins afterwards.
+        if (fTestBlockValidity && !PrepareBlockValidity(state, chainparams, *pblock, pindexPrev, snapshot, false, false)) {
+            if (pcache)
+                pcache->Invalidate();
+            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+        }
+    }
+
+    if (fTestBlockValidity && !TestBlockValiditySnapshot(state, chainparams, *pblock, snapshot)) {
+        if (pcache)
+            pcache->Invalidate();
         throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint("bench", "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint("bench", "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants%s), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, fIncremental ? ", incremental" : "", 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
     return std::move(pblocktemplate);
 }
@@ -324,6 +410,13 @@ bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
     return true;
 }
 
+void BlockAssembler::PackageSelected(CAmount packageFees, uint64_t packageSize)
+{
+    CFeeRate packageFeeRate(packageFees, packageSize);
+    if (packageFeeRate < minPackageFeeRate)
+        minPackageFeeRate = packageFeeRate;
+}
+
 void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 {
     pblock->vtx.emplace_back(iter->GetSharedTx());
@@ -539,12 +632,113 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         ++nPackagesSelected;
+        PackageSelected(packageFees, packageSize);
 
         // Update transactions that depend on each of these
         nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
     }
 }
 
+bool BlockAssembler::TryAddPackage(CTxMemPool::txiter iter, CFeeRate& packageFeeRate)
+{
+    CTxMemPool::setEntries ancestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+    onlyUnconfirmed(ancestors);
+    ancestors.insert(iter);
+
+    uint64_t packageSize = 0;
+    CAmount packageFees = 0;
+    int64_t packageSigOpsCost = 0;
+    BOOST_FOREACH(CTxMemPool::txiter it, ancestors) {
+        packageSize += it->GetTxSize();
+        packageFees += it->GetModifiedFee();
+        packageSigOpsCost += it->GetSigOpCost();
+    }
+
+    packageFeeRate = CFeeRate(packageFees, packageSize);
+    if (packageFees < blockMinFeeRate.GetFee(packageSize))
+        return false;
+    if (!TestPackage(packageSize, packageSigOpsCost) || !TestPackageTransactions(ancestors))
+        return false;
+
+    std::vector<CTxMemPool::txiter> sortedEntries;
+    SortForBlock(ancestors, iter, sortedEntries);
+    for (size_t i = 0; i < sortedEntries.size(); ++i) {
+        AddToBlock(sortedEntries[i]);
+    }
+    PackageSelected(packageFees, packageSize);
+    return true;
+}
+
+bool BlockAssembler::addCachedTxs(BlockTemplateCache& cache, const CBlockIndex* pindexPrev, int &nPackagesSelected)
+{
+    LOCK(cache.cs);
+    if (!cache.fValid || cache.pindexPrev != pindexPrev || cache.fIncludeWitness != fIncludeWitness ||
+            cache.nBlockMaxWeight != nBlockMaxWeight || cache.nBlockMaxSize != nBlockMaxSize ||
+            !(cache.blockMinFeeRate == blockMinFeeRate)) {
+        return false;
+    }
+
+    // On the same tip with the same settings, everything still in the mempool
+    // still fits, pays enough and is final. Drop what has left the mempool,
+    // and anything that would be left without its parent.
+    BOOST_FOREACH(const uint256& hash, cache.vSelected) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it != mempool.mapTx.end() && !isStillDependent(it))
+            AddToBlock(it);
+    }
+
+    minPackageFeeRate = cache.minPackageFeeRate;
+
+    // Offer what arrived since, in arrival order, so that parents come first.
+    // A low paying parent that was passed over is pulled in by a child paying
+    // enough for both.
+    BOOST_FOREACH(const uint256& hash, cache.vPendingAdded) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end() || inBlock.count(it))
+            continue;
+        CFeeRate packageFeeRate;
+        if (TryAddPackage(it, packageFeeRate)) {
+            ++nPackagesSelected;
+        } else if (minPackageFeeRate < packageFeeRate) {
+            // It would have been chosen over something already in the block,
+            // which only a selection from scratch can take out again.
+            const bool fIncludeWitnessBlock = fIncludeWitness;
+            resetBlock();
+            fIncludeWitness = fIncludeWitnessBlock;
+            pblock->vtx.resize(1);
+            pblocktemplate->vTxFees.resize(1);
+            pblocktemplate->vTxSigOpsCost.resize(1);
+            nPackagesSelected = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+void BlockAssembler::storeCachedTxs(BlockTemplateCache& cache, const CBlockIndex* pindexPrev)
+{
+    LOCK(cache.cs);
+    cache.fValid = true;
+    cache.pindexPrev = pindexPrev;
+    cache.fIncludeWitness = fIncludeWitness;
+    cache.nBlockMaxWeight = nBlockMaxWeight;
+    cache.nBlockMaxSize = nBlockMaxSize;
+    cache.blockMinFeeRate = blockMinFeeRate;
+    cache.minPackageFeeRate = minPackageFeeRate;
+
+    // Skip the coinbase placeholder
+    cache.vSelected.clear();
+    cache.vSelected.reserve(pblock->vtx.size() - 1);
+    for (size_t i = 1; i < pblock->vtx.size(); ++i) {
+        cache.vSelected.push_back(pblock->vtx[i]->GetHash());
+    }
+    cache.vPendingAdded.clear();
+}
+
 void BlockAssembler::addPriorityTxs()
 {
     // How much of the block should be dedicated to high-priority transactions,
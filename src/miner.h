@@ -23,6 +23,14 @@ class CWallet;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -genproclimit, the number of threads used by generate (0 = one per core) */
+static const int DEFAULT_GENPROCLIMIT = 0;
+/** Default for -incrementaltemplate, keep the transaction selection between block templates */
+static const bool DEFAULT_INCREMENTAL_TEMPLATE = true;
+/** Default for -checkblocktemplates, connect each new block template to check it is valid */
+static const bool DEFAULT_CHECK_BLOCK_TEMPLATES = true;
+/** Mempool additions queued for the next template before the selection is dropped instead */
+static const size_t MAX_TEMPLATE_PENDING_TXS = 100000;
 
 struct CBlockTemplate
 {
@@ -130,6 +138,56 @@ struct update_for_parent_inclusion
     CTxMemPool::txiter iter;
 };
 
+/**
+ * The transactions chosen for the last block template, kept so that the next
+ * template on the same tip does not have to walk the whole mempool again.
+ *
+ * Mempool additions are queued as they happen and offered to the block, as
+ * packages with their unselected ancestors, the next time a template is made.
+ * Selected transactions that have left the mempool are dropped from the block
+ * along with anything spending them. A new tip, or different block settings,
+ * make the next template start from scratch, as does a fee delta from
+ * prioritisetransaction, or an arrival that pays more than the lowest paying
+ * package selected but no longer fits.
+ */
+class BlockTemplateCache
+{
+private:
+    friend class BlockAssembler;
+
+    mutable CCriticalSection cs;
+    CTxMemPool& pool;
+
+    //! Whether vSelected is a usable selection for pindexPrev
+    bool fValid;
+    const CBlockIndex* pindexPrev;
+    // Settings the selection was made with
+    bool fIncludeWitness;
+    unsigned int nBlockMaxWeight, nBlockMaxSize;
+    CFeeRate blockMinFeeRate;
+
+    //! Selected transactions, in block order
+    std::vector<uint256> vSelected;
+    //! Transactions added to the mempool since the selection was made
+    std::vector<uint256> vPendingAdded;
+    //! Feerate of the lowest paying package in vSelected, when selected
+    CFeeRate minPackageFeeRate;
+
+    void TransactionAddedToMempool(CTransactionRef tx);
+    void TransactionRemovedFromMempool(CTransactionRef tx, MemPoolRemovalReason reason);
+    void TransactionPrioritised(CTransactionRef tx);
+
+public:
+    explicit BlockTemplateCache(CTxMemPool& poolIn);
+    ~BlockTemplateCache();
+
+    /** Forget the selection, so that the next template is built from scratch */
+    void Invalidate();
+};
+
+/** Selection reused by BlockAssembler, if incremental templates are enabled */
+extern std::unique_ptr<BlockTemplateCache> g_blocktemplatecache;
+
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
@@ -144,6 +202,7 @@ private:
     unsigned int nBlockMaxWeight, nBlockMaxSize;
     bool fNeedSizeAccounting;
     CFeeRate blockMinFeeRate;
+    bool fTestBlockValidity;
 
     // Information on the current status of the block
     uint64_t nBlockWeight;
@@ -152,6 +211,8 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    // Feerate of the lowest paying package selected, MAX_MONEY per kB if none
+    CFeeRate minPackageFeeRate;
 
     // Chain context for the block
     int nHeight;
@@ -173,6 +234,8 @@ private:
     void resetBlock();
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
+    /** Record the feerate of a package just added to the block */
+    void PackageSelected(CAmount packageFees, uint64_t packageSize);
 
     // Methods for how to add transactions to a block.
     /** Add transactions based on tx "priority" */
@@ -181,6 +244,13 @@ private:
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
     void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+    /** Add the transactions selected for the last template, then the packages
+      * of transactions that entered the mempool since. Returns false, leaving
+      * the block empty, if the cached selection does not apply to this block
+      * or a package that arrived since would displace part of it. */
+    bool addCachedTxs(BlockTemplateCache& cache, const CBlockIndex* pindexPrev, int &nPackagesSelected);
+    /** Remember the transactions now in the block for the next template */
+    void storeCachedTxs(BlockTemplateCache& cache, const CBlockIndex* pindexPrev);
 
     // helper function for addPriorityTxs
     /** Test if tx will still "fit" in the block */
@@ -201,6 +271,10 @@ private:
     /** Return true if given transaction from mapTx has already been evaluated,
       * or if the transaction's cached data in mapTx is incorrect. */
     bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
+    /** Add iter with its ancestors not yet in the block, if the package pays
+      * enough and fits. Returns whether the package was added, and its
+      * feerate in packageFeeRate either way. */
+    bool TryAddPackage(CTxMemPool::txiter iter, CFeeRate& packageFeeRate);
     /** Sort the package in an order that is valid to appear in a block */
     void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
     /** Add descendants of given transactions to mapModifiedTx with ancestor
@@ -15,7 +15,21 @@ unsigned int static VertoreumDifficulty(const CBlockIndex* pindexLast, const Con
 
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
-    return VertoreumDifficulty(pindexLast,params);
+    if (pindexLast == NULL)
+        return VertoreumDifficulty(pindexLast,params);
+
+    // Regtest keeps the minimum difficulty of its genesis block
+    if (params.fPowNoRetargeting)
+        return pindexLast->nBits;
+
+    // The target only depends on the ancestors of pindexLast, which never
+    // change, so it is computed once per index rather than walking back over
+    // the averaging window for every header, template and index check.
+    if (pindexLast->pparamsNextWork != &params) {
+        pindexLast->nNextWorkRequired = VertoreumDifficulty(pindexLast,params);
+        pindexLast->pparamsNextWork = &params;
+    }
+    return pindexLast->nNextWorkRequired;
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
 
     if (pindexLast == NULL)
@@ -0,0 +1,138 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "powcache.h"
+
+#include "consensus/params.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "hash/yescrypt/yescrypt-hash.h"
+#include "pow.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include "cuckoocache.h"
+#include <boost/thread.hpp>
+
+namespace {
+
+/**
+ * Entries are nonced hashes, so like the signature cache no extra blinding
+ * is needed in the set hash computation.
+ */
+class PoWCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select <8, "PoWCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin()+4*hash_select, 4);
+        return u;
+    }
+};
+
+/**
+ * Headers whose proof of work was found valid. The header hash commits to
+ * nBits, so an entry means the header meets its own claimed target.
+ */
+class CPoWCache
+{
+private:
+    //! Entries are SHA256(nonce || powLimit || header hash):
+    uint256 nonce;
+    typedef CuckooCache::cache<uint256, PoWCacheHasher> map_type;
+    map_type setValid;
+    boost::shared_mutex cs_powcache;
+
+public:
+    CPoWCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void
+    ComputeEntry(uint256& entry, const uint256& hash, const Consensus::Params& params)
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(params.powLimit.begin(), 32).Write(hash.begin(), 32).Finalize(entry.begin());
+    }
+
+    bool
+    Get(const uint256& entry)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_powcache);
+        return setValid.contains(entry, false);
+    }
+
+    void Set(uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_powcache);
+        setValid.insert(entry);
+    }
+    uint32_t setup_bytes(size_t n)
+    {
+        return setValid.setup_bytes(n);
+    }
+};
+
+static CPoWCache powCache;
+}
+
+void InitPoWCache()
+{
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxpowcachesize", DEFAULT_MAX_POW_CACHE_SIZE)), MAX_MAX_POW_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = powCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for proof-of-work cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+bool CheckProofOfWorkCached(const CBlockHeader& header, const Consensus::Params& params, YescryptContext* context)
+{
+    const CBlockHeader* pheader = &header;
+    bool fValid;
+    return CheckProofOfWorkCached(&pheader, 1, params, context, &fValid);
+}
+
+bool CheckProofOfWorkCached(const CBlockHeader* const* ppheaders, size_t nHeaders, const Consensus::Params& params, YescryptContext* context, bool* pfValid)
+{
+    assert(nHeaders <= MAX_POW_CACHE_BATCH);
+    static_assert(sizeof(CBlockHeader) == 80, "yescrypt hashes the header in place");
+    uint256 entries[MAX_POW_CACHE_BATCH];
+    size_t vMissed[MAX_POW_CACHE_BATCH];
+    size_t nMissed = 0;
+    for (size_t i = 0; i < nHeaders; i++) {
+        powCache.ComputeEntry(entries[i], ppheaders[i]->GetHash(), params);
+        pfValid[i] = powCache.Get(entries[i]);
+        if (!pfValid[i])
+            vMissed[nMissed++] = i;
+    }
+    if (nMissed == 0)
+        return true;
+
+    // Hash the headers that missed the cache together, so the yescrypt
+    // kernel can interleave them.
+    char inputs[MAX_POW_CACHE_BATCH * 80];
+    uint256 hashes[MAX_POW_CACHE_BATCH];
+    for (size_t j = 0; j < nMissed; j++)
+        memcpy(inputs + j * 80, BEGIN(ppheaders[vMissed[j]]->nVersion), 80);
+    if (context)
+        context->HashMany(inputs, BEGIN(hashes[0]), nMissed);
+    else
+        yescrypt_hash_many(inputs, BEGIN(hashes[0]), nMissed);
+
+    bool fAllValid = true;
+    for (size_t j = 0; j < nMissed; j++) {
+        size_t i = vMissed[j];
+        pfValid[i] = CheckProofOfWork(hashes[j], ppheaders[i]->nBits, params);
+        if (pfValid[i])
+            powCache.Set(entries[i]);
+        else
+            fAllValid = false;
+    }
+    return fAllValid;
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POWCACHE_H
+#define BITCOIN_POWCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class CBlockHeader;
+class YescryptContext;
+
+namespace Consensus {
+struct Params;
+}
+
+// Entries are 32 bytes, so 1MB holds over 30000 headers: far more than are
+// relayed or built upon between two checks of the same header.
+static const unsigned int DEFAULT_MAX_POW_CACHE_SIZE = 1;
+// Maximum proof-of-work cache size allowed
+static const int64_t MAX_MAX_POW_CACHE_SIZE = 1024;
+// Most headers checked together by one CheckProofOfWorkCached call
+static const size_t MAX_POW_CACHE_BATCH = 8;
+
+/** To be called once in AppInit2/TestingSetup to initialize the proof-of-work cache */
+void InitPoWCache();
+
+/**
+ * Check the proof of work of a header like CheckProofOfWork(header.GetPoWHash(), ...),
+ * remembering headers found valid so that the same header arriving again
+ * (as a header, compact block or full block) or being re-checked for a block
+ * template does not have its yescrypt hash computed again. If given, context
+ * provides the scratch memory for the hash.
+ */
+bool CheckProofOfWorkCached(const CBlockHeader& header, const Consensus::Params& params, YescryptContext* context = NULL);
+
+/**
+ * As above for up to MAX_POW_CACHE_BATCH headers at once, hashing those not
+ * already cached in one pass so that their yescrypt computations interleave.
+ * Sets pfValid[i] for each header and returns whether all of them are valid.
+ */
+bool CheckProofOfWorkCached(const CBlockHeader* const* ppheaders, size_t nHeaders, const Consensus::Params& params, YescryptContext* context, bool* pfValid);
+
+#endif // BITCOIN_POWCACHE_H
@@ -10,8 +10,7 @@
 #include "utilstrencodings.h"
 #include "crypto/common.h"
 #include "crypto/scrypt.h"
-
-extern "C" void yescrypt_hash(const char *input, char *output);
+#include "hash/yescrypt/yescrypt-hash.h"
 
 uint256 CBlockHeader::GetHash() const
 {
@@ -25,6 +24,13 @@ uint256 CBlockHeader::GetPoWHash() const
     return thash;
 }
 
+uint256 CBlockHeader::GetPoWHash(YescryptContext& context) const
+{
+    uint256 thash;
+    context.Hash(BEGIN(nVersion), BEGIN(thash));
+    return thash;
+}
+
 std::string CBlock::ToString() const
 {
     std::stringstream s;
@@ -10,6 +10,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+class YescryptContext;
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -63,6 +65,7 @@ public:
     uint256 GetHash() const;
 
     uint256 GetPoWHash() const;
+    uint256 GetPoWHash(YescryptContext& context) const;
 
     int64_t GetBlockTime() const
     {
@@ -167,11 +167,25 @@ static int ecdsa_signature_parse_der_lax(const secp256k1_context* ctx, secp256k1
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+    return CParsedPubKey(*this).Verify(hash, vchSig);
+}
+
+static_assert(sizeof(secp256k1_pubkey) == 64, "CParsedPubKey assumes a 64-byte secp256k1_pubkey");
+
+CParsedPubKey::CParsedPubKey(const CPubKey& pubkey) : fValid(false) {
+    secp256k1_pubkey parsed;
+    if (pubkey.IsValid() && secp256k1_ec_pubkey_parse(secp256k1_context_verify, &parsed, pubkey.begin(), pubkey.size())) {
+        memcpy(vch, &parsed, sizeof(vch));
+        fValid = true;
+    }
+}
+
+bool CParsedPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!fValid)
+        return false;
     secp256k1_pubkey pubkey;
     secp256k1_ecdsa_signature sig;
-    if (!secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, &(*this)[0], size())) {
-        return false;
-    }
+    memcpy(&pubkey, vch, sizeof(vch));
     if (vchSig.size() == 0) {
         return false;
     }
@@ -190,6 +190,31 @@ public:
     bool Derive(CPubKey& pubkeyChild, ChainCode &ccChild, unsigned int nChild, const ChainCode& cc) const;
 };
 
+/**
+ * A public key parsed (and, if compressed, decompressed) into libsecp256k1's
+ * internal form once, to verify any number of signatures under it.
+ */
+class CParsedPubKey
+{
+private:
+    //! The parsed key, an opaque libsecp256k1 secp256k1_pubkey.
+    unsigned char vch[64];
+    bool fValid;
+
+public:
+    CParsedPubKey() : fValid(false) {}
+    explicit CParsedPubKey(const CPubKey& pubkey);
+
+    //! Whether the key was fully valid; if not, Verify always fails.
+    bool IsValid() const
+    {
+        return fValid;
+    }
+
+    //! Verify a DER signature, with the same result as CPubKey::Verify.
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+};
+
 struct CExtPubKey {
     unsigned char nDepth;
     unsigned char vchFingerprint[4];
@@ -15,6 +15,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -773,6 +774,21 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    stats.nTransactions++;
+    stats.nSerializedSize += 32;
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
@@ -785,32 +801,31 @@ static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            // Outputs of the same transaction are adjacent in the database,
+            // so they are grouped back together before being hashed.
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
+            prevkey = key.hash;
+            stats.nSerializedSize += pcursor->GetValueSize();
+            outputs[key.n] = std::move(coin);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -903,6 +918,97 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
     return ret;
 }
 
+static UniValue DBLatencyToJSON(const CDBLatencyStats& latency)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("count", latency.nCount));
+    ret.push_back(Pair("average_us", latency.nCount ? (double)latency.nTotalMicros / latency.nCount : 0.0));
+    UniValue histogram(UniValue::VARR);
+    for (uint64_t nBucket : latency.vBuckets)
+        histogram.push_back(nBucket);
+    ret.push_back(Pair("histogram", histogram));
+    return ret;
+}
+
+static UniValue DBStatsToJSON(const CDBStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("cache_hits", stats.nCacheHits));
+    ret.push_back(Pair("cache_misses", stats.nCacheMisses));
+    uint64_t nLookups = stats.nCacheHits + stats.nCacheMisses;
+    ret.push_back(Pair("cache_hit_rate", nLookups ? (double)stats.nCacheHits / nLookups : 0.0));
+    ret.push_back(Pair("stalled_writes", stats.nStalledWrites));
+    ret.push_back(Pair("memory_usage", stats.nMemoryUsage));
+    ret.push_back(Pair("reads", DBLatencyToJSON(stats.reads)));
+    ret.push_back(Pair("writes", DBLatencyToJSON(stats.writes)));
+    UniValue levels(UniValue::VARR);
+    for (const CDBLevelStats& level : stats.vLevels) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("level", level.nLevel));
+        obj.push_back(Pair("files", level.nFiles));
+        obj.push_back(Pair("size_mb", level.dSizeMB));
+        obj.push_back(Pair("compaction_sec", level.dCompactionSec));
+        obj.push_back(Pair("compaction_read_mb", level.dCompactionReadMB));
+        obj.push_back(Pair("compaction_write_mb", level.dCompactionWriteMB));
+        levels.push_back(obj);
+    }
+    ret.push_back(Pair("levels", levels));
+    return ret;
+}
+
+UniValue getdbstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns LevelDB statistics of the chain state and block index databases since startup.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {               (json object) The chain state database\n"
+            "    \"cache_hits\": n,            (numeric) Block cache lookups that found the block\n"
+            "    \"cache_misses\": n,          (numeric) Block cache lookups that had to read the block from disk\n"
+            "    \"cache_hit_rate\": x.xxx,    (numeric) Share of block cache lookups that were hits\n"
+            "    \"stalled_writes\": n,        (numeric) Writes issued while level 0 had enough files for LevelDB to slow them down\n"
+            "    \"memory_usage\": n,          (numeric) Approximate memory used by LevelDB, in bytes\n"
+            "    \"reads\": {                  (json object) Lookups\n"
+            "      \"count\": n,               (numeric) Number of lookups\n"
+            "      \"average_us\": x.xxx,      (numeric) Average latency in microseconds\n"
+            "      \"histogram\": [ n, ... ]   (array) Entry i counts lookups that took under 2^i and at least 2^(i-1) microseconds\n"
+            "    },\n"
+            "    \"writes\": { ... },          (json object) Batch writes, as for reads\n"
+            "    \"levels\": [                 (array) Levels that hold files or have been compacted into\n"
+            "      {\n"
+            "        \"level\": n,             (numeric) The level\n"
+            "        \"files\": n,             (numeric) Number of table files\n"
+            "        \"size_mb\": x.xxx,       (numeric) Size of the table files, in MB\n"
+            "        \"compaction_sec\": x.xxx,      (numeric) Time spent compacting into this level\n"
+            "        \"compaction_read_mb\": x.xxx,  (numeric) Data read by those compactions, in MB\n"
+            "        \"compaction_write_mb\": x.xxx  (numeric) Data written by those compactions, in MB\n"
+            "      }, ...\n"
+            "    ]\n"
+            "  },\n"
+            "  \"blockindex\": { ... }         (json object) The block index database, as for chainstate\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    CDBStats statsChainstate, statsBlockIndex;
+    {
+        LOCK(cs_main);
+        if (!pcoinsdbview || !pblocktree)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Databases are not open");
+        pcoinsdbview->GetDBStats(statsChainstate);
+        pblocktree->GetStats(statsBlockIndex);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("chainstate", DBStatsToJSON(statsChainstate)));
+    ret.push_back(Pair("blockindex", DBStatsToJSON(statsBlockIndex)));
+    return ret;
+}
+
 UniValue gettxout(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 2 || request.params.size() > 3)
@@ -928,7 +1034,6 @@ UniValue gettxout(const JSONRPCRequest& request)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -952,33 +1057,34 @@ UniValue gettxout(const JSONRPCRequest& request)
     if (request.params.size() > 2)
         fMempool = request.params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        // The view returns coins spent by mempool transactions, so filter them here
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -1425,6 +1531,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true,  {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         true,  {"blockhash","verbose"} },
     { "blockchain",         "getchaintips",           &getchaintips,           true,  {} },
+    { "blockchain",         "getdbstats",             &getdbstats,             true,  {} },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true,  {} },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true,  {"txid","verbose"} },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true,  {"txid","verbose"} },
@@ -11,6 +11,7 @@
 #include "consensus/params.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "hash.h"
 #include "init.h"
 #include "validation.h"
 #include "miner.h"
@@ -22,11 +23,15 @@
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <atomic>
+#include <limits>
 #include <memory>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 
 #include <univalue.h>
 
@@ -96,6 +101,69 @@ UniValue getnetworkhashps(const JSONRPCRequest& request)
     return GetNetworkHashPS(request.params.size() > 0 ? request.params[0].get_int() : 120, request.params.size() > 1 ? request.params[1].get_int() : -1);
 }
 
+/**
+ * Try the nonces nFirstNonce, nFirstNonce + nStep, ... below nNonceEnd on a
+ * copy of header, until one satisfies the proof of work or another worker has
+ * found one (nFound != nNonceEnd) or the shared budget of tries runs out.
+ * Consecutive nonces of this worker are hashed POW_CHECK_HEADERS at a time so
+ * that their yescrypt computations interleave.
+ */
+static void GrindNonces(CBlockHeader header, uint32_t nFirstNonce, uint32_t nStep, uint32_t nNonceEnd,
+                        YescryptContext* context, std::atomic<uint32_t>* nFound, std::atomic<int64_t>* nTriesLeft)
+{
+    static_assert(sizeof(CBlockHeader) == 80, "yescrypt hashes the header in place");
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    char inputs[POW_CHECK_HEADERS * 80];
+    uint256 hashes[POW_CHECK_HEADERS];
+    uint64_t nNonce = nFirstNonce;
+    while (nNonce < nNonceEnd && *nFound == nNonceEnd) {
+        int64_t nTries = std::min<uint64_t>(POW_CHECK_HEADERS, (nNonceEnd - nNonce + nStep - 1) / nStep);
+        int64_t nBudget = nTriesLeft->fetch_sub(nTries);
+        if (nBudget <= 0)
+            return;
+        nTries = std::min(nTries, nBudget);
+        for (int64_t i = 0; i < nTries; i++) {
+            header.nNonce = nNonce + i * nStep;
+            memcpy(inputs + i * 80, BEGIN(header.nVersion), 80);
+        }
+        context->HashMany(inputs, BEGIN(hashes[0]), nTries);
+        // The lowest nonce that passes is taken, as when hashing one at a time.
+        for (int64_t i = 0; i < nTries; i++) {
+            if (CheckProofOfWork(hashes[i], header.nBits, consensusParams)) {
+                uint32_t nExpected = nNonceEnd;
+                nFound->compare_exchange_strong(nExpected, nNonce + i * nStep);
+                return;
+            }
+        }
+        nNonce += nTries * nStep;
+    }
+}
+
+/**
+ * Search the nonces below nNonceEnd of pblock for one that satisfies the proof
+ * of work, spread over one thread per context. Returns whether one was found,
+ * in which case it is set in pblock. nMaxTries is reduced by the hashes tried.
+ */
+static bool GrindBlock(CBlock* pblock, uint32_t nNonceEnd, uint64_t& nMaxTries, std::vector<std::unique_ptr<YescryptContext> >& contexts)
+{
+    std::atomic<uint32_t> nFound(nNonceEnd);
+    std::atomic<int64_t> nTriesLeft(std::min<uint64_t>(nMaxTries, std::numeric_limits<int64_t>::max()));
+    const uint32_t nThreads = contexts.size();
+    if (nThreads == 1) {
+        GrindNonces(pblock->GetBlockHeader(), 0, 1, nNonceEnd, contexts[0].get(), &nFound, &nTriesLeft);
+    } else {
+        boost::thread_group threadGroup;
+        for (uint32_t i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&GrindNonces, pblock->GetBlockHeader(), i, nThreads, nNonceEnd, contexts[i].get(), &nFound, &nTriesLeft));
+        threadGroup.join_all();
+    }
+    nMaxTries = std::max<int64_t>(nTriesLeft, 0);
+    if (nFound == nNonceEnd)
+        return false;
+    pblock->nNonce = nFound;
+    return true;
+}
+
 UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript)
 {
     static const int nInnerLoopCount = 0x10000;
@@ -111,6 +179,15 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
     }
     unsigned int nExtraNonce = 0;
     UniValue blockHashes(UniValue::VARR);
+
+    // One yescrypt scratch area per mining thread, reused for all blocks
+    int nThreads = GetArg("-genproclimit", DEFAULT_GENPROCLIMIT);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    std::vector<std::unique_ptr<YescryptContext> > contexts;
+    for (int i = 0; i < std::max(nThreads, 1); i++)
+        contexts.emplace_back(new YescryptContext());
+
     while (nHeight < nHeightEnd)
     {
         std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
@@ -121,14 +198,10 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
             LOCK(cs_main);
             IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
         }
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
-        if (nMaxTries == 0) {
-            break;
-        }
-        if (pblock->nNonce == nInnerLoopCount) {
+        if (!GrindBlock(pblock, nInnerLoopCount, nMaxTries, contexts)) {
+            if (nMaxTries == 0) {
+                break;
+            }
             continue;
         }
         std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(*pblock);
@@ -539,20 +612,30 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = nullptr;
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
         nStart = GetTime();
         fLastTemplateSupportsSegwit = fSupportsSegwit;
 
-        // Create new block
+        // Create new block. CreateNewBlock takes the main lock only while it
+        // selects transactions, so release it for the validity check; the
+        // shared template is only replaced once the lock is held again.
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, fSupportsSegwit);
-        if (!pblocktemplate)
+        std::unique_ptr<CBlockTemplate> pblocktemplateNew;
+        LEAVE_CRITICAL_SECTION(cs_main);
+        try {
+            pblocktemplateNew = BlockAssembler(Params()).CreateNewBlock(scriptDummy, fSupportsSegwit);
+        } catch (...) {
+            ENTER_CRITICAL_SECTION(cs_main);
+            throw;
+        }
+        ENTER_CRITICAL_SECTION(cs_main);
+        if (!pblocktemplateNew)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        pblocktemplate = std::move(pblocktemplateNew);
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        // Need to update only after we know CreateNewBlock succeeded, with the
+        // tip it was built on, which may no longer be the active one
+        pindexPrev = mapBlockIndex[pblocktemplate->block.hashPrevBlock];
     }
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -131,3 +131,76 @@ size_t CScheduler::getQueueInfo(boost::chrono::system_clock::time_point &first,
     }
     return result;
 }
+
+void SingleThreadedSchedulerClient::MaybeScheduleProcessQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csCallbacksPending);
+        // A running ProcessQueue schedules the next one when it is done.
+        if (fCallbacksRunning || callbacksPending.empty())
+            return;
+    }
+    // Two ProcessQueue tasks may end up scheduled at once; the second one
+    // finds the callbacks running, or none left, and returns.
+    pscheduler->schedule(boost::bind(&SingleThreadedSchedulerClient::ProcessQueue, this), boost::chrono::system_clock::now());
+}
+
+void SingleThreadedSchedulerClient::ProcessQueue()
+{
+    CScheduler::Function callback;
+    {
+        boost::unique_lock<boost::mutex> lock(csCallbacksPending);
+        if (fCallbacksRunning || callbacksPending.empty())
+            return;
+        fCallbacksRunning = true;
+        callback.swap(callbacksPending.front());
+        callbacksPending.pop_front();
+    }
+
+    // Clear fCallbacksRunning and schedule the rest even if the callback throws.
+    struct CallbacksRunningGuard {
+        SingleThreadedSchedulerClient* client;
+        explicit CallbacksRunningGuard(SingleThreadedSchedulerClient* clientIn) : client(clientIn) {}
+        ~CallbacksRunningGuard()
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(client->csCallbacksPending);
+                client->fCallbacksRunning = false;
+            }
+            client->MaybeScheduleProcessQueue();
+        }
+    } guard(this);
+
+    callback();
+}
+
+void SingleThreadedSchedulerClient::AddToProcessQueue(CScheduler::Function func)
+{
+    assert(pscheduler);
+    {
+        boost::unique_lock<boost::mutex> lock(csCallbacksPending);
+        callbacksPending.push_back(func);
+    }
+    MaybeScheduleProcessQueue();
+}
+
+void SingleThreadedSchedulerClient::EmptyQueue()
+{
+    while (true) {
+        CScheduler::Function callback;
+        {
+            boost::unique_lock<boost::mutex> lock(csCallbacksPending);
+            if (callbacksPending.empty())
+                return;
+            callback.swap(callbacksPending.front());
+            callbacksPending.pop_front();
+        }
+        callback();
+    }
+}
+
+size_t SingleThreadedSchedulerClient::CallbacksPending()
+{
+    boost::unique_lock<boost::mutex> lock(csCallbacksPending);
+    return callbacksPending.size();
+}
@@ -13,6 +13,7 @@
 #include <boost/function.hpp>
 #include <boost/chrono/chrono.hpp>
 #include <boost/thread.hpp>
+#include <list>
 #include <map>
 
 //
@@ -80,4 +81,35 @@ private:
     bool shouldStop() { return stopRequested || (stopWhenEmpty && taskQueue.empty()); }
 };
 
+/**
+ * Runs callbacks on a CScheduler one at a time, in the order in which they
+ * were added. It does not need a thread of its own: at most one task that
+ * works through the callbacks is on the scheduler at a time, so callbacks
+ * never run concurrently, whichever scheduler thread picks them up.
+ */
+class SingleThreadedSchedulerClient
+{
+public:
+    explicit SingleThreadedSchedulerClient(CScheduler* pschedulerIn) : pscheduler(pschedulerIn), fCallbacksRunning(false) {}
+
+    // Run func on the scheduler after every callback added before it
+    void AddToProcessQueue(CScheduler::Function func);
+
+    // Run the callbacks still queued on the calling thread. Only for use once
+    // the scheduler has stopped servicing its queue, e.g. at shutdown.
+    void EmptyQueue();
+
+    size_t CallbacksPending();
+
+private:
+    CScheduler* pscheduler;
+
+    boost::mutex csCallbacksPending;
+    std::list<CScheduler::Function> callbacksPending;
+    bool fCallbacksRunning;
+
+    void MaybeScheduleProcessQueue();
+    void ProcessQueue();
+};
+
 #endif
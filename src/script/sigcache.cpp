@@ -107,9 +107,29 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
     if (signatureCache.Get(entry, !store))
         return true;
-    if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
+    bool fValid = pkcache ? pkcache->Verify(pubkey, sighash, vchSig) : TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash);
+    if (!fValid)
         return false;
     if (store)
         signatureCache.Set(entry);
     return true;
 }
+
+bool CPubKeyParseCache::Verify(const CPubKey& pubkey, const uint256& sighash, const std::vector<unsigned char>& vchSig)
+{
+    if (!pubkey.IsValid())
+        return false;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        std::map<CPubKey, CParsedPubKey>::const_iterator it = mapParsed.find(pubkey);
+        if (it != mapParsed.end())
+            return it->second.Verify(sighash, vchSig);
+    }
+    // Parse outside the lock; another thread may have parsed the same key meanwhile.
+    CParsedPubKey parsed(pubkey);
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        mapParsed.insert(std::make_pair(pubkey, parsed));
+    }
+    return parsed.Verify(sighash, vchSig);
+}
@@ -6,10 +6,14 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "pubkey.h"
 #include "script/interpreter.h"
 
+#include <map>
 #include <vector>
 
+#include <boost/thread/shared_mutex.hpp>
+
 // DoS prevention: limit cache size to 32MB (over 1000000 entries on 64-bit
 // systems). Due to how we count cache size, actual memory usage is slightly
 // more (~32.25 MB)
@@ -17,15 +21,30 @@ static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
 // Maximum sig cache size allowed
 static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
 
-class CPubKey;
+/**
+ * Public keys parsed while checking the scripts of one block. It is shared by
+ * the script check threads, so that a key which signs many inputs of the
+ * block (such as a pool's payout key) is parsed and decompressed only once.
+ */
+class CPubKeyParseCache
+{
+private:
+    boost::shared_mutex cs;
+    std::map<CPubKey, CParsedPubKey> mapParsed;
+
+public:
+    //! Verify a signature like CPubKey::Verify, parsing the key only on first use.
+    bool Verify(const CPubKey& pubkey, const uint256& sighash, const std::vector<unsigned char>& vchSig);
+};
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
+    CPubKeyParseCache* pkcache;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, PrecomputedTransactionData& txdataIn) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, PrecomputedTransactionData& txdataIn, CPubKeyParseCache* pkcacheIn = NULL) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn), pkcache(pkcacheIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
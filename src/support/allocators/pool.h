@@ -0,0 +1,194 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <assert.h>
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Hands out small blocks of memory carved from large chunks, and keeps freed
+ * blocks in per-size free lists for reuse. Node based containers allocate
+ * one node at a time; drawing those from a pool saves the malloc overhead
+ * and bookkeeping of every node, and keeps nodes close together in memory.
+ *
+ * Requests larger than MAX_BLOCK_SIZE_BYTES, or with a stricter alignment
+ * than ALIGN_BYTES, are passed on to operator new. Memory handed out from
+ * chunks is only returned to the system when the resource is destroyed.
+ *
+ * Not thread safe.
+ */
+template <size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+class PoolResource
+{
+    /** Freed blocks link to each other through their own memory. */
+    struct ListNode {
+        ListNode* next;
+    };
+
+    //! Block sizes are multiples of this, so that every block is aligned
+    static const size_t ELEM_ALIGN_BYTES = ALIGN_BYTES > sizeof(ListNode) ? ALIGN_BYTES : sizeof(ListNode);
+    static_assert((ELEM_ALIGN_BYTES & (ELEM_ALIGN_BYTES - 1)) == 0, "ELEM_ALIGN_BYTES must be a power of two");
+    static_assert(ELEM_ALIGN_BYTES >= alignof(ListNode), "blocks must be able to hold a ListNode");
+    static_assert(ELEM_ALIGN_BYTES <= alignof(std::max_align_t), "operator new must return chunks aligned for the blocks");
+
+    //! Free list heads, indexed by block size in units of ELEM_ALIGN_BYTES
+    ListNode* vFreeLists[MAX_BLOCK_SIZE_BYTES / ELEM_ALIGN_BYTES + 1];
+    std::vector<char*> vChunks;
+    const size_t nChunkSizeBytes;
+    //! Unused tail of the newest chunk
+    char* pAvailable;
+    char* pAvailableEnd;
+
+    static size_t NumElemAlignBytes(size_t nBytes)
+    {
+        return (nBytes + ELEM_ALIGN_BYTES - 1) / ELEM_ALIGN_BYTES + (nBytes == 0);
+    }
+
+    static bool IsFreeListUsable(size_t nBytes, size_t nAlignment)
+    {
+        return nAlignment <= ELEM_ALIGN_BYTES && nBytes <= MAX_BLOCK_SIZE_BYTES;
+    }
+
+    void PushFree(ListNode*& head, void* p)
+    {
+        ListNode* node = static_cast<ListNode*>(p);
+        node->next = head;
+        head = node;
+    }
+
+    void AllocateChunk()
+    {
+        // Keep what is left of the current chunk; it is smaller than the
+        // request that did not fit, but can serve smaller ones.
+        if (pAvailable != pAvailableEnd) {
+            size_t nRemaining = (pAvailableEnd - pAvailable) / ELEM_ALIGN_BYTES;
+            PushFree(vFreeLists[nRemaining], pAvailable);
+        }
+        char* pChunk = static_cast<char*>(::operator new(nChunkSizeBytes));
+        vChunks.push_back(pChunk);
+        pAvailable = pChunk;
+        pAvailableEnd = pChunk + nChunkSizeBytes;
+    }
+
+public:
+    static const size_t DEFAULT_CHUNK_SIZE_BYTES = 256 * 1024;
+
+    explicit PoolResource(size_t nChunkSizeBytesIn = DEFAULT_CHUNK_SIZE_BYTES) :
+        nChunkSizeBytes(nChunkSizeBytesIn / ELEM_ALIGN_BYTES * ELEM_ALIGN_BYTES), pAvailable(NULL), pAvailableEnd(NULL)
+    {
+        assert(nChunkSizeBytes >= MAX_BLOCK_SIZE_BYTES);
+        for (ListNode*& head : vFreeLists)
+            head = NULL;
+    }
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+    ~PoolResource()
+    {
+        for (char* pChunk : vChunks)
+            ::operator delete(pChunk);
+    }
+
+    void* Allocate(size_t nBytes, size_t nAlignment)
+    {
+        if (!IsFreeListUsable(nBytes, nAlignment))
+            return ::operator new(nBytes);
+
+        const size_t nElems = NumElemAlignBytes(nBytes);
+        ListNode*& head = vFreeLists[nElems];
+        if (head != NULL) {
+            ListNode* node = head;
+            head = node->next;
+            return node;
+        }
+        const size_t nRoundedBytes = nElems * ELEM_ALIGN_BYTES;
+        if ((size_t)(pAvailableEnd - pAvailable) < nRoundedBytes)
+            AllocateChunk();
+        void* p = pAvailable;
+        pAvailable += nRoundedBytes;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlignment)
+    {
+        if (!IsFreeListUsable(nBytes, nAlignment)) {
+            ::operator delete(p);
+            return;
+        }
+        PushFree(vFreeLists[NumElemAlignBytes(nBytes)], p);
+    }
+
+    size_t NumAllocatedChunks() const { return vChunks.size(); }
+    size_t ChunkSizeBytes() const { return nChunkSizeBytes; }
+};
+
+/**
+ * Allocator drawing from a PoolResource. A default constructed allocator
+ * creates a resource of its own; copies, including those rebound to the
+ * container's node type, share it. The resource moves along with the
+ * allocator when a container is moved or swapped, so each container keeps
+ * using a single resource of its own and the resource lives as long as the
+ * container that uses it.
+ */
+template <typename T, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES = alignof(T)>
+class PoolAllocator
+{
+public:
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+private:
+    template <typename U, size_t M, size_t A>
+    friend class PoolAllocator;
+
+    std::shared_ptr<ResourceType> resource;
+
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::false_type propagate_on_container_copy_assignment;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    PoolAllocator() : resource(std::make_shared<ResourceType>()) {}
+
+    //! Also used for moves, which must not leave the source without a resource
+    PoolAllocator(const PoolAllocator& other) : resource(other.resource) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) : resource(other.resource) {}
+
+    //! A copied container gets a resource of its own
+    PoolAllocator select_on_container_copy_construction() const { return PoolAllocator(); }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    const ResourceType& Resource() const { return *resource; }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) const { return resource == other.resource; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) const { return resource != other.resource; }
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -4,10 +4,12 @@
 
 #include "util.h"
 
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -231,4 +233,72 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     BOOST_CHECK(pool.stats().used == initial.used);
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_tests)
+{
+    PoolResource<128, 8> resource(1024);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0U);
+
+    // Blocks of the same rounded size are carved one after the other.
+    void* a = resource.Allocate(20, 8);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+    BOOST_CHECK_EQUAL((char*)b - (char*)a, 24);
+
+    // Freed blocks are handed out again, for requests of the same rounded size only.
+    resource.Deallocate(a, 20, 8);
+    void* c = resource.Allocate(32, 8);
+    BOOST_CHECK(c != a);
+    BOOST_CHECK(resource.Allocate(17, 8) == a);
+
+    // Too large, or too strictly aligned, requests go to operator new.
+    void* d = resource.Allocate(129, 8);
+    void* e = resource.Allocate(16, 16);
+    resource.Deallocate(d, 129, 8);
+    resource.Deallocate(e, 16, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+
+    // A new chunk is started once the current one runs out.
+    for (int i = 0; i < 8; i++)
+        resource.Allocate(128, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2U);
+    resource.Deallocate(b, 24, 8);
+    resource.Deallocate(c, 32, 8);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_tests)
+{
+    typedef PoolAllocator<std::pair<const int, int>, 64, 8> Allocator;
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>, Allocator> Map;
+
+    Map a, b;
+    BOOST_CHECK(a.get_allocator() != b.get_allocator());
+    for (int i = 0; i < 1000; i++)
+        a[i] = i;
+    const Allocator::ResourceType* resourceA = &a.get_allocator().Resource();
+    BOOST_CHECK(resourceA->NumAllocatedChunks() > 0);
+
+    // Swapping hands the pool to the other map along with the nodes.
+    a.swap(b);
+    BOOST_CHECK(&b.get_allocator().Resource() == resourceA);
+    BOOST_CHECK_EQUAL(a.get_allocator().Resource().NumAllocatedChunks(), 0U);
+    BOOST_CHECK_EQUAL(b.size(), 1000U);
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(b[i], i);
+
+    // So does moving; a copy gets a pool of its own.
+    Map c(std::move(b));
+    BOOST_CHECK(&c.get_allocator().Resource() == resourceA);
+    Map d(c);
+    BOOST_CHECK(&d.get_allocator().Resource() != resourceA);
+    BOOST_CHECK_EQUAL(d.size(), 1000U);
+
+    // Erased nodes are reused.
+    size_t nChunks = resourceA->NumAllocatedChunks();
+    for (int i = 0; i < 1000; i++)
+        c.erase(i);
+    for (int i = 1000; i < 2000; i++)
+        c[i] = i;
+    BOOST_CHECK_EQUAL(resourceA->NumAllocatedChunks(), nChunks);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,101 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <atomic>
+
+#include <boost/thread/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static const unsigned int QUEUE_BATCH_SIZE = 128;
+
+/** Counts its executions, and fails if it was created to. */
+struct FakeCheck {
+    std::atomic<unsigned int>* pnCount;
+    bool fOk;
+
+    FakeCheck() : pnCount(NULL), fOk(true) {}
+    FakeCheck(std::atomic<unsigned int>& nCount, bool fOkIn) : pnCount(&nCount), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        ++*pnCount;
+        return fOk;
+    }
+
+    void swap(FakeCheck& x)
+    {
+        std::swap(pnCount, x.pnCount);
+        std::swap(fOk, x.fOk);
+    }
+};
+
+/** Add nTotal checks in randomly sized batches, failing the one at nFail if given. */
+static void AddChecks(CCheckQueueControl<FakeCheck>& control, std::atomic<unsigned int>& nCount, size_t nTotal, size_t nFail = -1)
+{
+    size_t nAdded = 0;
+    while (nAdded < nTotal) {
+        size_t nBatch = std::min(nTotal - nAdded, (size_t)(insecure_rand() % 300));
+        std::vector<FakeCheck> vChecks;
+        for (size_t i = 0; i < nBatch; i++)
+            vChecks.push_back(FakeCheck(nCount, nAdded + i != nFail));
+        control.Add(vChecks);
+        nAdded += nBatch;
+    }
+}
+
+static void TestQueue(int nThreads)
+{
+    CCheckQueue<FakeCheck> queue(QUEUE_BATCH_SIZE);
+    boost::thread_group tg;
+    for (int i = 0; i < nThreads; i++)
+        tg.create_thread([&]{queue.Thread();});
+
+    for (size_t nTotal : {0, 1, 2, 10, 100, 1000, 10000}) {
+        std::atomic<unsigned int> nCount(0);
+        CCheckQueueControl<FakeCheck> control(&queue);
+        AddChecks(control, nCount, nTotal);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nCount.load(), nTotal);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    // A failing check fails the round, and the next round starts afresh.
+    for (int nRound = 0; nRound < 10; nRound++) {
+        bool fFail = nRound % 2 == 0;
+        std::atomic<unsigned int> nCount(0);
+        CCheckQueueControl<FakeCheck> control(&queue);
+        AddChecks(control, nCount, 1000, fFail ? insecure_rand() % 1000 : -1);
+        BOOST_CHECK(control.Wait() == !fFail);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_master_only)
+{
+    TestQueue(0);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    TestQueue(1);
+    TestQueue(3);
+    TestQueue(16);
+}
+
+// More workers than deques, so that some of them share one.
+BOOST_AUTO_TEST_CASE(checkqueue_shared_queues)
+{
+    TestQueue(100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
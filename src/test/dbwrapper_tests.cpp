@@ -318,6 +318,46 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, false);
+    CDBStats statsOpen;
+    dbw.GetStats(statsOpen);
+
+    for (uint32_t i = 0; i < 100; i++)
+        BOOST_CHECK(dbw.Write(i, GetRandHash()));
+    // Move everything out of the memtable into table files, so that the
+    // reads below go through the block cache.
+    dbw.CompactRange((uint32_t)0, (uint32_t)100);
 
+    uint256 res;
+    for (uint32_t i = 0; i < 100; i++) {
+        BOOST_CHECK(dbw.Read(i, res));
+        BOOST_CHECK(dbw.Exists(i));
+    }
+    BOOST_CHECK(!dbw.Exists((uint32_t)100));
+
+    CDBStats stats;
+    dbw.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.writes.nCount - statsOpen.writes.nCount, 100U);
+    BOOST_CHECK_EQUAL(stats.reads.nCount - statsOpen.reads.nCount, 201U);
+    uint64_t nBucketed = 0;
+    for (uint64_t nBucket : stats.reads.vBuckets)
+        nBucketed += nBucket;
+    BOOST_CHECK_EQUAL(nBucketed, stats.reads.nCount);
+    BOOST_CHECK_EQUAL(stats.reads.vBuckets.size(), (size_t)CDBLatencyStats::BUCKETS);
+
+    // Every read of a present key looks up a data block. Whether those hit
+    // depends on the environment: blocks of memory mapped files are not cached.
+    BOOST_CHECK(stats.nCacheHits + stats.nCacheMisses >= 200);
+    BOOST_CHECK_EQUAL(stats.nStalledWrites, 0U);
+
+    int nFiles = 0;
+    for (const CDBLevelStats& level : stats.vLevels)
+        nFiles += level.nFiles;
+    BOOST_CHECK(nFiles >= 1);
+    BOOST_CHECK(!stats.ToString().empty());
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -105,6 +105,12 @@ BOOST_AUTO_TEST_CASE(siphash)
 
     BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
 
+    // SipHashUint256Extra is the SipHash of the 32 bytes of the uint256 followed by the 4 little-endian bytes of extra
+    const uint256 valExtra = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    static const unsigned char extra[4] = {0x20, 0x21, 0x22, 0x23};
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, valExtra, 0x23222120),
+                      CSipHasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL).Write(valExtra.begin(), 32).Write(extra, 4).Finalize());
+
     // Check test vectors from spec, one byte at a time
     CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
     for (uint8_t x=0; x<ARRAYLEN(siphash_4_2_testvec); ++x)
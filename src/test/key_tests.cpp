@@ -6,6 +6,8 @@
 
 #include "base58.h"
 #include "script/script.h"
+#include "script/sigcache.h"
+#include "random.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -186,4 +188,47 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+BOOST_AUTO_TEST_CASE(parsed_pubkey)
+{
+    CPubKeyParseCache pkcache;
+    for (int i = 0; i < 8; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        CParsedPubKey parsed(pubkey);
+        BOOST_CHECK(parsed.IsValid());
+
+        std::string strMsg = strprintf("Message %d", i);
+        uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+        uint256 hashOther = Hash(hashMsg.begin(), hashMsg.end());
+        std::vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hashMsg, vchSig));
+
+        // The same results as CPubKey::Verify, directly and through the cache
+        // (which parses the key on the first round and reuses it after).
+        for (int nRound = 0; nRound < 2; nRound++) {
+            BOOST_CHECK(parsed.Verify(hashMsg, vchSig));
+            BOOST_CHECK(pkcache.Verify(pubkey, hashMsg, vchSig));
+            BOOST_CHECK(!parsed.Verify(hashOther, vchSig));
+            BOOST_CHECK(!pkcache.Verify(pubkey, hashOther, vchSig));
+            BOOST_CHECK(!parsed.Verify(hashMsg, std::vector<unsigned char>()));
+            BOOST_CHECK(!pkcache.Verify(pubkey, hashMsg, std::vector<unsigned char>()));
+        }
+    }
+
+    // A key that is not on the curve never verifies.
+    std::vector<unsigned char> vchBad(33, 0xff);
+    vchBad[0] = 0x02;
+    CPubKey pubkeyBad(vchBad);
+    BOOST_CHECK(!CParsedPubKey(pubkeyBad).IsValid());
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hashMsg = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hashMsg, vchSig));
+    BOOST_CHECK(!CParsedPubKey(pubkeyBad).Verify(hashMsg, vchSig));
+    BOOST_CHECK(!pkcache.Verify(pubkeyBad, hashMsg, vchSig));
+    BOOST_CHECK(!pkcache.Verify(pubkeyBad, hashMsg, vchSig));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
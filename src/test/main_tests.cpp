@@ -5,6 +5,8 @@
 #include "chainparams.h"
 #include "validation.h"
 #include "net.h"
+#include "random.h"
+#include "streams.h"
 
 #include "test/test_bitcoin.h"
 
@@ -73,4 +75,31 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(read_raw_block_test)
+{
+    // The genesis block was written to disk when the chain was initialized.
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    BOOST_CHECK(pindexGenesis->nStatus & BLOCK_HAVE_DATA);
+
+    std::vector<unsigned char> vchRaw;
+    BOOST_CHECK(ReadRawBlockFromDisk(vchRaw, pindexGenesis, Params().MessageStart()));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << Params().GenesisBlock();
+    BOOST_CHECK(vchRaw == std::vector<unsigned char>(ssBlock.begin(), ssBlock.end()));
+
+    // Wrong network magic, and a position that is not the start of the block.
+    CMessageHeader::MessageStartChars wrongStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchRaw, pindexGenesis, wrongStart));
+    CBlockIndex indexShifted(*pindexGenesis);
+    indexShifted.nDataPos++;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchRaw, &indexShifted, Params().MessageStart()));
+
+    // Data at the right place that is not the indexed block.
+    const uint256 hashOther = GetRandHash();
+    CBlockIndex indexOther(*pindexGenesis);
+    indexOther.phashBlock = &hashOther;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchRaw, &indexOther, Params().MessageStart()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,13 +2,21 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "consensus/validation.h"
+#include "key.h"
 #include "policy/policy.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
+#include "validation.h"
 
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <limits>
 #include <list>
 #include <vector>
 
@@ -105,6 +113,126 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(testPool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolUpdateFromBlockTest)
+{
+    // Test CTxMemPool::UpdateTransactionsFromBlock, which links a transaction
+    // from a disconnected block back to the mempool descendants it already had
+
+    TestMemPoolEntryHelper entry;
+    // Parent transaction with three children, and three grand-children:
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[3];
+    CMutableTransaction txGrandChild[3];
+    for (int i = 0; i < 3; i++)
+    {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+
+        txGrandChild[i].vin.resize(1);
+        txGrandChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txGrandChild[i].vin[0].prevout = COutPoint(txChild[i].GetHash(), 0);
+        txGrandChild[i].vout.resize(1);
+        txGrandChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txGrandChild[i].vout[0].nValue = 11000LL;
+    }
+    std::vector<uint256> vHashUpdate(1, txParent.GetHash());
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+
+    CTxMemPool testPool(CFeeRate(0));
+    LOCK(testPool.cs);
+
+    // The descendants are in the mempool before the parent comes back
+    for (int i = 0; i < 3; i++)
+    {
+        testPool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), entry.FromTx(txGrandChild[i]));
+    }
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 1);
+
+    // Without limits everything is linked and accounted for
+    testPool.UpdateTransactionsFromBlock(vHashUpdate, nNoLimit, nNoLimit, nNoLimit, nNoLimit);
+    BOOST_CHECK_EQUAL(testPool.size(), 7);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 7);
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_CHECK_EQUAL(testPool.mapTx.find(txChild[i].GetHash())->GetCountWithAncestors(), 2);
+        BOOST_CHECK_EQUAL(testPool.mapTx.find(txGrandChild[i].GetHash())->GetCountWithAncestors(), 3);
+    }
+    testPool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+
+    // Descendants past the ancestor limit are evicted
+    for (int i = 0; i < 3; i++)
+    {
+        testPool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), entry.FromTx(txGrandChild[i]));
+    }
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    testPool.UpdateTransactionsFromBlock(vHashUpdate, 2, nNoLimit, nNoLimit, nNoLimit);
+    BOOST_CHECK_EQUAL(testPool.size(), 4);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 4);
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(!testPool.exists(txGrandChild[i].GetHash()));
+    testPool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+
+    // Children that would take the parent past the descendant limit are not
+    // linked, and are evicted with their descendants
+    for (int i = 0; i < 3; i++)
+    {
+        testPool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), entry.FromTx(txGrandChild[i]));
+    }
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    testPool.UpdateTransactionsFromBlock(vHashUpdate, nNoLimit, nNoLimit, 5, nNoLimit);
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 1);
+    BOOST_CHECK(testPool.GetMemPoolChildren(testPool.mapTx.find(txParent.GetHash())).empty());
+    testPool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+
+    // The parent and a child both come back from the block. The child is
+    // linked to its own in-mempool child first, which takes the parent past
+    // the descendant limit, so that grandchild is evicted.
+    std::vector<uint256> vHashBlock;
+    vHashBlock.push_back(txParent.GetHash());
+    vHashBlock.push_back(txChild[0].GetHash());
+    testPool.addUnchecked(txGrandChild[0].GetHash(), entry.FromTx(txGrandChild[0]));
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    testPool.addUnchecked(txChild[0].GetHash(), entry.FromTx(txChild[0]));
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 2);
+    testPool.UpdateTransactionsFromBlock(vHashBlock, nNoLimit, nNoLimit, 2, nNoLimit);
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+    BOOST_CHECK(!testPool.exists(txGrandChild[0].GetHash()));
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txChild[0].GetHash())->GetCountWithDescendants(), 1);
+    testPool.removeRecursive(txParent);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+
+    // Within the limit, the grandchild stays and counts for both
+    testPool.addUnchecked(txGrandChild[0].GetHash(), entry.FromTx(txGrandChild[0]));
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    testPool.addUnchecked(txChild[0].GetHash(), entry.FromTx(txChild[0]));
+    testPool.UpdateTransactionsFromBlock(vHashBlock, nNoLimit, nNoLimit, 3, nNoLimit);
+    BOOST_CHECK_EQUAL(testPool.size(), 3);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txChild[0].GetHash())->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txGrandChild[0].GetHash())->GetCountWithAncestors(), 3);
+}
+
 template<typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -584,4 +712,205 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(DisconnectedBlockTransactionsTest)
+{
+    // Two disconnected blocks of two transactions each, the second spending
+    // the first, disconnected from the tip down as DisconnectTip does
+    CTransactionRef vTx[4];
+    COutPoint prevout;
+    for (int i = 0; i < 4; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11;
+        tx.vin[0].prevout = prevout;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        vTx[i] = MakeTransactionRef(tx);
+        prevout = COutPoint(vTx[i]->GetHash(), 0);
+    }
+    std::vector<CTransactionRef> vBlock1(vTx, vTx + 2), vBlock2(vTx + 2, vTx + 4);
+
+    DisconnectedBlockTransactions disconnectpool;
+    BOOST_CHECK_EQUAL(disconnectpool.DynamicMemoryUsage(), 0U);
+    for (auto it = vBlock2.rbegin(); it != vBlock2.rend(); ++it)
+        disconnectpool.addTransaction(*it);
+    for (auto it = vBlock1.rbegin(); it != vBlock1.rend(); ++it)
+        disconnectpool.addTransaction(*it);
+    BOOST_CHECK_EQUAL(disconnectpool.queuedTx.size(), 4U);
+    size_t nUsage = disconnectpool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+
+    // Walking the insertion order backwards gives dependency order
+    int i = 0;
+    const auto& queuedTx = disconnectpool.queuedTx.get<insertion_order>();
+    for (auto it = queuedTx.rbegin(); it != queuedTx.rend(); ++it)
+        BOOST_CHECK((*it)->GetHash() == vTx[i++]->GetHash());
+
+    // A block connected on the new chain confirms the first block again
+    disconnectpool.removeForBlock(vBlock1);
+    BOOST_CHECK_EQUAL(disconnectpool.queuedTx.size(), 2U);
+    BOOST_CHECK(disconnectpool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(disconnectpool.queuedTx.count(vTx[2]->GetHash()));
+
+    // Evicting the oldest entry drops the last transaction of the tip block
+    disconnectpool.removeEntry(disconnectpool.queuedTx.get<insertion_order>().begin());
+    BOOST_CHECK_EQUAL(disconnectpool.queuedTx.size(), 1U);
+    BOOST_CHECK(disconnectpool.queuedTx.count(vTx[2]->GetHash()));
+
+    disconnectpool.removeEntry(disconnectpool.queuedTx.get<insertion_order>().begin());
+    BOOST_CHECK_EQUAL(disconnectpool.DynamicMemoryUsage(), 0U);
+}
+
+
+// Spend an output worth nValue, paying it back minus a fee to nOutputs
+// standard anyone-can-spend outputs, and provide the script to spend one
+static CMutableTransaction SpendOutput(const COutPoint& prevout, CAmount nValue, int nOutputs)
+{
+    CScript redeemScript = CScript() << OP_TRUE;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << ToByteVector(redeemScript);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+        tx.vout[i].nValue = (nValue - 10000) / nOutputs;
+    }
+    return tx;
+}
+
+// Sign a spend of a TestChain100Setup coinbase
+static void SignCoinbaseSpend(CMutableTransaction& tx, const CKey& key)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig = CScript() << vchSig;
+}
+
+static bool ToMemPool(const CMutableTransaction& tx)
+{
+    CValidationState state;
+    return AcceptToMemoryPool(mempool, state, MakeTransactionRef(tx), false, NULL, NULL, true, 0);
+}
+
+// The lock checks removeForReorg evaluates inline, done the regular way
+static bool IsLockedNow(const CMutableTransaction& tx)
+{
+    LOCK(mempool.cs);
+    return !CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS) || !CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS);
+}
+
+BOOST_FIXTURE_TEST_CASE(MempoolUpdateForReorgTest, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    for (int i = 0; i < 2; i++)
+        CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+
+    LOCK(cs_main);
+    const int nTipHeight = chainActive.Height();
+    BOOST_CHECK_EQUAL(nTipHeight, COINBASE_MATURITY + 2);
+
+    // Block A confirms tx1 and txNonStd, which spends tx1 with a non-minimal
+    // push: valid by consensus, but failing the standard script checks. The
+    // reorg pre-verifies it with the block flags, and leaves it out of the
+    // mempool all the same.
+    CMutableTransaction tx1 = SpendOutput(COutPoint(coinbaseTxns[0].GetHash(), 0), coinbaseTxns[0].vout[0].nValue, 4);
+    SignCoinbaseSpend(tx1, coinbaseKey);
+    CMutableTransaction txNonStd = SpendOutput(COutPoint(tx1.GetHash(), 1), tx1.vout[1].nValue, 1);
+    const unsigned char nonMinimalPush[] = {OP_PUSHDATA1, 0x01, 0x01};
+    txNonStd.vin[0].scriptSig = CScript(nonMinimalPush, nonMinimalPush + sizeof(nonMinimalPush)) + txNonStd.vin[0].scriptSig;
+    std::vector<CMutableTransaction> vBlockTx;
+    vBlockTx.push_back(tx1);
+    vBlockTx.push_back(txNonStd);
+    CreateAndProcessBlock(vBlockTx, scriptPubKey);
+    CBlockIndex* pindexA = chainActive.Tip();
+    BOOST_CHECK_EQUAL(pindexA->nHeight, nTipHeight + 1);
+    BOOST_CHECK(pindexA->GetBlockHash() != chainActive[nTipHeight]->GetBlockHash());
+
+    // A child of tx1 stays behind with it on a reorg
+    CMutableTransaction txChild = SpendOutput(COutPoint(tx1.GetHash(), 0), tx1.vout[0].nValue, 1);
+    BOOST_CHECK(ToMemPool(txChild));
+    // Final only at block A's height
+    CMutableTransaction txLockTime = SpendOutput(COutPoint(tx1.GetHash(), 2), tx1.vout[2].nValue, 1);
+    txLockTime.vin[0].nSequence = 0;
+    txLockTime.nLockTime = nTipHeight + 1;
+    BOOST_CHECK(ToMemPool(txLockTime));
+    // Relative height locks, one on an output of block A that returns to
+    // the mempool and one on a coin that stays confirmed
+    CMutableTransaction txSeqMempool = SpendOutput(COutPoint(tx1.GetHash(), 3), tx1.vout[3].nValue, 1);
+    txSeqMempool.nVersion = 2;
+    txSeqMempool.vin[0].nSequence = 1;
+    BOOST_CHECK(ToMemPool(txSeqMempool));
+    CMutableTransaction txSeqConfirmed = SpendOutput(COutPoint(coinbaseTxns[2].GetHash(), 0), coinbaseTxns[2].vout[0].nValue, 1);
+    txSeqConfirmed.nVersion = 2;
+    txSeqConfirmed.vin[0].nSequence = nTipHeight - 1;
+    SignCoinbaseSpend(txSeqConfirmed, coinbaseKey);
+    BOOST_CHECK(ToMemPool(txSeqConfirmed));
+    // A coinbase spend that is mature only on top of block A, which
+    // removeForReorg drops without it being time-locked
+    CMutableTransaction txImmature = SpendOutput(COutPoint(coinbaseTxns[3].GetHash(), 0), coinbaseTxns[3].vout[0].nValue, 1);
+    SignCoinbaseSpend(txImmature, coinbaseKey);
+    BOOST_CHECK(ToMemPool(txImmature));
+    // Locked up to a height still below the new tip, so it stays
+    CMutableTransaction txStays = SpendOutput(COutPoint(coinbaseTxns[1].GetHash(), 0), coinbaseTxns[1].vout[0].nValue, 1);
+    txStays.nVersion = 2;
+    txStays.vin[0].nSequence = 1;
+    txStays.nLockTime = nTipHeight;
+    SignCoinbaseSpend(txStays, coinbaseKey);
+    BOOST_CHECK(ToMemPool(txStays));
+    BOOST_CHECK_EQUAL(mempool.size(), 6U);
+
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, Params(), pindexA));
+    BOOST_CHECK_EQUAL(chainActive.Height(), nTipHeight);
+
+    // tx1 is back and linked to its child; txNonStd is not standard
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(mempool.exists(tx1.GetHash()));
+    BOOST_CHECK(!mempool.exists(txNonStd.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    BOOST_CHECK(mempool.exists(txStays.GetHash()));
+    BOOST_CHECK_EQUAL(mempool.mapTx.find(txChild.GetHash())->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(mempool.mapTx.find(tx1.GetHash())->GetCountWithDescendants(), 2U);
+
+    // The time-locked transactions were removed exactly when the regular
+    // checks consider them locked
+    BOOST_CHECK(!mempool.exists(txLockTime.GetHash()));
+    BOOST_CHECK(!mempool.exists(txSeqMempool.GetHash()));
+    BOOST_CHECK(!mempool.exists(txSeqConfirmed.GetHash()));
+    BOOST_CHECK(!mempool.exists(txImmature.GetHash()));
+    BOOST_CHECK(IsLockedNow(txLockTime));
+    BOOST_CHECK(IsLockedNow(txSeqMempool));
+    BOOST_CHECK(IsLockedNow(txSeqConfirmed));
+    BOOST_CHECK(!IsLockedNow(txImmature));
+    BOOST_CHECK(!IsLockedNow(tx1));
+    BOOST_CHECK(!IsLockedNow(txChild));
+    BOOST_CHECK(!IsLockedNow(txStays));
+
+    // Reconsidering block A confirms tx1 again
+    ResetBlockFailureFlags(pindexA);
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+    BOOST_CHECK(chainActive.Tip() == pindexA);
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(!mempool.exists(tx1.GetHash()));
+    BOOST_CHECK_EQUAL(mempool.mapTx.find(txChild.GetHash())->GetCountWithAncestors(), 1U);
+
+    // Without room to keep the disconnected transactions, tx1 is dropped
+    // and takes its child along
+    ForceSetArg("-maxdisconnectedpool", "0");
+    BOOST_CHECK(InvalidateBlock(state, Params(), pindexA));
+    ForceSetArg("-maxdisconnectedpool", std::to_string(MAX_DISCONNECTED_TX_POOL_SIZE));
+    BOOST_CHECK_EQUAL(chainActive.Height(), nTipHeight);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+    BOOST_CHECK(!mempool.exists(tx1.GetHash()));
+    BOOST_CHECK(!mempool.exists(txChild.GetHash()));
+    BOOST_CHECK(mempool.exists(txStays.GetHash()));
+
+    mempool.clear();
+}
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "key.h"
 #include "validation.h"
 #include "miner.h"
 #include "policy/policy.h"
@@ -489,8 +490,179 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     mempool.clear();
 
     TestPackageSelection(chainparams, scriptPubKey, txFirst);
+    mempool.clear();
 
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(CreateNewBlock_snapshot_validity)
+{
+    const CChainParams& chainparams = Params(CBaseChainParams::MAIN);
+    CScript scriptPubKey = CScript() << OP_TRUE;
+
+    LOCK(cs_main);
+    fCheckpointsEnabled = false;
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    BOOST_CHECK(pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    const CBlock& block = pblocktemplate->block;
+
+    // The template itself passes against a snapshot of the tip
+    {
+        CValidationState state;
+        CBlockValiditySnapshot snapshot;
+        BOOST_CHECK(PrepareBlockValidity(state, chainparams, block, chainActive.Tip(), snapshot, false, false));
+        BOOST_CHECK(TestBlockValiditySnapshot(state, chainparams, block, snapshot));
+    }
+
+    // A coinbase paying more than the subsidy is caught without the chain
+    {
+        CBlock blockBad(block);
+        CMutableTransaction txCoinbase(*blockBad.vtx[0]);
+        txCoinbase.vout[0].nValue += 1;
+        blockBad.vtx[0] = MakeTransactionRef(std::move(txCoinbase));
+        CValidationState state;
+        CBlockValiditySnapshot snapshot;
+        BOOST_CHECK(PrepareBlockValidity(state, chainparams, blockBad, chainActive.Tip(), snapshot, false, false));
+        BOOST_CHECK(!TestBlockValiditySnapshot(state, chainparams, blockBad, snapshot));
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-cb-amount");
+    }
+
+    // So is a spend of a coin the snapshot does not have
+    {
+        CBlock blockBad(block);
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        blockBad.vtx.push_back(MakeTransactionRef(std::move(tx)));
+        CValidationState state;
+        CBlockValiditySnapshot snapshot;
+        BOOST_CHECK(PrepareBlockValidity(state, chainparams, blockBad, chainActive.Tip(), snapshot, false, false));
+        BOOST_CHECK(!TestBlockValiditySnapshot(state, chainparams, blockBad, snapshot));
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-inputs-missingorspent");
+    }
+
+    fCheckpointsEnabled = true;
+}
+
+// Spend a coinbase paying to key, less nFee, to an output anyone can spend.
+static CMutableTransaction SpendCoinbase(const CTransaction& txCoinbase, const CKey& key, CAmount nFee)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txCoinbase.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = txCoinbase.vout[0].nValue - nFee;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_incremental, TestChain100Setup)
+{
+    // Test that a selection kept between templates follows the mempool.
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    TestMemPoolEntryHelper entry;
+
+    // Let the coinbases of the first few blocks mature
+    for (int i = 0; i < 3; i++)
+        CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+
+    LOCK(cs_main);
+    g_blocktemplatecache.reset(new BlockTemplateCache(mempool));
+
+    CMutableTransaction tx = SpendCoinbase(coinbaseTxns[0], coinbaseKey, 10000);
+    CTransactionRef firstTx = MakeTransactionRef(tx);
+    mempool.addUnchecked(firstTx->GetHash(), entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == firstTx->GetHash());
+
+    // A free transaction that arrives is left out...
+    tx = SpendCoinbase(coinbaseTxns[1], coinbaseKey, 0);
+    uint256 hashFreeTx = tx.GetHash();
+    CAmount nFreeValue = tx.vout[0].nValue;
+    mempool.addUnchecked(hashFreeTx, entry.Fee(0).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // ...until a child arrives that pays for both.
+    tx.vin[0].prevout = COutPoint(hashFreeTx, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout[0].nValue = nFreeValue - 50000;
+    uint256 hashChildTx = tx.GetHash();
+    mempool.addUnchecked(hashChildTx, entry.Fee(50000).SpendsCoinbase(false).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 4);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == firstTx->GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == hashFreeTx);
+    BOOST_CHECK(pblocktemplate->block.vtx[3]->GetHash() == hashChildTx);
+
+    // Transactions leaving the mempool leave the template, with their
+    // descendants.
+    mempool.removeRecursive(*pblocktemplate->block.vtx[2]);
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == firstTx->GetHash());
+
+    // A fee delta for a transaction that was passed over is honoured by the
+    // next template, ahead of what pays less.
+    tx = SpendCoinbase(coinbaseTxns[2], coinbaseKey, 0);
+    uint256 hashPrioritisedTx = tx.GetHash();
+    mempool.addUnchecked(hashPrioritisedTx, entry.Fee(0).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    mempool.PrioritiseTransaction(hashPrioritisedTx, hashPrioritisedTx.ToString(), 0.0, 20000);
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashPrioritisedTx);
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == firstTx->GetHash());
+
+    // A block taking transactions out of the mempool makes the template start
+    // from scratch.
+    mempool.removeForBlock(std::vector<CTransactionRef>(1, firstTx), chainActive.Height() + 1);
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashPrioritisedTx);
+    mempool.ClearPrioritisation(hashPrioritisedTx);
+    mempool.clear();
+
+    // In a block with room for one transaction, an arrival paying less than
+    // the one selected is left out...
+    ForceSetArg("-blockmaxweight", "4800");
+    tx = SpendCoinbase(coinbaseTxns[0], coinbaseKey, 10000);
+    uint256 hashSelectedTx = tx.GetHash();
+    mempool.addUnchecked(hashSelectedTx, entry.Fee(10000).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashSelectedTx);
+    tx = SpendCoinbase(coinbaseTxns[1], coinbaseKey, 5000);
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(5000).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashSelectedTx);
+
+    // ...but one paying more takes its place.
+    tx = SpendCoinbase(coinbaseTxns[2], coinbaseKey, 20000);
+    uint256 hashBetterTx = tx.GetHash();
+    mempool.addUnchecked(hashBetterTx, entry.Fee(20000).SpendsCoinbase(true).FromTx(tx));
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashBetterTx);
+    ForceSetArg("-blockmaxweight", std::to_string(DEFAULT_BLOCK_MAX_WEIGHT));
+    ForceSetArg("-blockmaxsize", std::to_string(DEFAULT_BLOCK_MAX_SIZE));
+
+    mempool.clear();
+    g_blocktemplatecache.reset();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
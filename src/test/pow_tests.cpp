@@ -5,8 +5,10 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "pow.h"
+#include "powcache.h"
 #include "random.h"
 #include "util.h"
+#include "validation.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
@@ -93,4 +95,127 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* Test that the memoized next work matches a fresh computation under each set of params */
+BOOST_AUTO_TEST_CASE(get_next_work_memoized)
+{
+    const Consensus::Params& mainParams = Params(CBaseChainParams::MAIN).GetConsensus();
+    const Consensus::Params& testnetParams = Params(CBaseChainParams::TESTNET).GetConsensus();
+
+    std::vector<CBlockIndex> blocks(100);
+    for (int i = 0; i < 100; i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = 1500000000 + i * mainParams.nPowTargetSpacing / (1 + i % 3);
+        blocks[i].nBits = 0x1e0ffff0 - 0x100 * (i % 7);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        unsigned int nMain = GetNextWorkRequired(&blocks[i], NULL, mainParams);
+        BOOST_CHECK(blocks[i].pparamsNextWork == &mainParams);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], NULL, mainParams), nMain);
+
+        // Switching params recomputes rather than reusing the cached value.
+        unsigned int nTestnet = GetNextWorkRequired(&blocks[i], NULL, testnetParams);
+        BOOST_CHECK(blocks[i].pparamsNextWork == &testnetParams);
+        if (i < 24)
+            BOOST_CHECK_EQUAL(nTestnet, UintToArith256(testnetParams.powLimit).GetCompact());
+
+        blocks[i].pparamsNextWork = NULL;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], NULL, mainParams), nMain);
+        blocks[i].pparamsNextWork = NULL;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], NULL, testnetParams), nTestnet);
+    }
+    BOOST_CHECK(GetNextWorkRequired(&blocks[99], NULL, mainParams) != UintToArith256(mainParams.powLimit).GetCompact());
+}
+
+BOOST_AUTO_TEST_CASE(get_next_work_no_retargeting)
+{
+    const Consensus::Params& regtestParams = Params(CBaseChainParams::REGTEST).GetConsensus();
+    BOOST_CHECK(regtestParams.fPowNoRetargeting);
+    const unsigned int nRegtestLimit = UintToArith256(regtestParams.powLimit).GetCompact();
+
+    // Blocks at a tenth of the target spacing, which DarkGravityWave would
+    // make harder; its arithmetic overflows at the regtest limit.
+    std::vector<CBlockIndex> blocks(100);
+    for (int i = 0; i < 100; i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = 1500000000 + i * regtestParams.nPowTargetSpacing / 10;
+        blocks[i].nBits = nRegtestLimit;
+    }
+
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], NULL, regtestParams), nRegtestLimit);
+
+    Consensus::Params retargetingParams = regtestParams;
+    retargetingParams.fPowNoRetargeting = false;
+    BOOST_CHECK(GetNextWorkRequired(&blocks[99], NULL, retargetingParams) != nRegtestLimit);
+}
+
+BOOST_AUTO_TEST_CASE(pow_cache)
+{
+    const Consensus::Params& mainParams = Params(CBaseChainParams::MAIN).GetConsensus();
+    const Consensus::Params& regtestParams = Params(CBaseChainParams::REGTEST).GetConsensus();
+
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.nTime = 1500000000;
+    header.nBits = UintToArith256(regtestParams.powLimit).GetCompact();
+    while (!CheckProofOfWork(header.GetPoWHash(), header.nBits, regtestParams))
+        header.nNonce++;
+
+    // Valid headers are remembered, and found again.
+    BOOST_CHECK(CheckProofOfWorkCached(header, regtestParams));
+    BOOST_CHECK(CheckProofOfWorkCached(header, regtestParams));
+
+    // A header valid under one chain's limit is not taken as valid under another.
+    BOOST_CHECK(!CheckProofOfWorkCached(header, mainParams));
+
+    // Changing any field, including the claimed target, misses the cache.
+    header.nBits = UintToArith256(mainParams.powLimit).GetCompact();
+    BOOST_CHECK_EQUAL(CheckProofOfWorkCached(header, regtestParams), CheckProofOfWork(header.GetPoWHash(), header.nBits, regtestParams));
+}
+
+BOOST_AUTO_TEST_CASE(pow_cache_batch)
+{
+    const Consensus::Params& regtestParams = Params(CBaseChainParams::REGTEST).GetConsensus();
+
+    CBlockHeader valid;
+    valid.nVersion = 4;
+    valid.nTime = 1500000001;
+    valid.nBits = UintToArith256(regtestParams.powLimit).GetCompact();
+    CBlockHeader invalid = valid;
+    while (!CheckProofOfWork(valid.GetPoWHash(), valid.nBits, regtestParams))
+        valid.nNonce++;
+    while (CheckProofOfWork(invalid.GetPoWHash(), invalid.nBits, regtestParams))
+        invalid.nNonce++;
+
+    // Each header of a batch gets its own verdict, as if checked alone.
+    const CBlockHeader* pheaders[2] = {&invalid, &valid};
+    bool fValid[2];
+    BOOST_CHECK(!CheckProofOfWorkCached(pheaders, 2, regtestParams, NULL, fValid));
+    BOOST_CHECK(!fValid[0]);
+    BOOST_CHECK(fValid[1]);
+    YescryptContext context;
+    BOOST_CHECK(!CheckProofOfWorkCached(pheaders, 2, regtestParams, &context, fValid));
+    BOOST_CHECK(!fValid[0]);
+    BOOST_CHECK(fValid[1]);
+    pheaders[0] = &valid;
+    BOOST_CHECK(CheckProofOfWorkCached(pheaders, 2, regtestParams, &context, fValid));
+    BOOST_CHECK(fValid[0] && fValid[1]);
+
+    // A PoW check takes up to POW_CHECK_HEADERS headers and marks those that pass.
+    CPoWCheck check(regtestParams);
+    char vValid[POW_CHECK_HEADERS + 1] = {};
+    BOOST_CHECK(check.Add(invalid, &vValid[0]));
+    for (unsigned int i = 1; i < POW_CHECK_HEADERS; i++)
+        BOOST_CHECK(check.Add(valid, &vValid[i]));
+    BOOST_CHECK(!check.Add(valid, &vValid[POW_CHECK_HEADERS]));
+    BOOST_CHECK(!check());
+    BOOST_CHECK(!vValid[0]);
+    for (unsigned int i = 1; i < POW_CHECK_HEADERS; i++)
+        BOOST_CHECK(vValid[i]);
+    BOOST_CHECK(!vValid[POW_CHECK_HEADERS]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
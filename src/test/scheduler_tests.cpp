@@ -4,6 +4,8 @@
 
 #include "random.h"
 #include "scheduler.h"
+#include "primitives/transaction.h"
+#include "validationinterface.h"
 
 #include "test/test_bitcoin.h"
 
@@ -114,4 +116,92 @@ BOOST_AUTO_TEST_CASE(manythreads)
     BOOST_CHECK_EQUAL(counterSum, 200);
 }
 
+BOOST_AUTO_TEST_CASE(singlethreadedclient_ordered)
+{
+    CScheduler scheduler;
+
+    // Each client's callbacks must run one at a time and in order, even
+    // with several threads servicing the scheduler.
+    SingleThreadedSchedulerClient client1(&scheduler);
+    SingleThreadedSchedulerClient client2(&scheduler);
+    int counter1 = 0, counter2 = 0;
+    for (int i = 0; i < 100; i++) {
+        client1.AddToProcessQueue([i, &counter1]() { BOOST_CHECK_EQUAL(counter1++, i); });
+        client2.AddToProcessQueue([i, &counter2]() { BOOST_CHECK_EQUAL(counter2++, i); });
+    }
+    BOOST_CHECK_EQUAL(client1.CallbacksPending(), 100U);
+
+    boost::thread_group threads;
+    for (int i = 0; i < 5; i++)
+        threads.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    scheduler.stop(true);
+    threads.join_all();
+
+    BOOST_CHECK_EQUAL(counter1, 100);
+    BOOST_CHECK_EQUAL(counter2, 100);
+    BOOST_CHECK_EQUAL(client1.CallbacksPending(), 0U);
+
+    // Without a running scheduler, EmptyQueue runs what is left.
+    client1.AddToProcessQueue([&counter1]() { counter1++; });
+    client1.EmptyQueue();
+    BOOST_CHECK_EQUAL(counter1, 101);
+}
+
+class BackgroundSubscriber : public CValidationInterface
+{
+public:
+    std::vector<uint256> vHashes;
+    boost::thread::id threadId;
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int posInBlock)
+    {
+        vHashes.push_back(tx.GetHash());
+        threadId = boost::this_thread::get_id();
+    }
+    void UpdatedTransaction(const uint256& hash)
+    {
+        vHashes.push_back(hash);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(background_validation_interface)
+{
+    CScheduler scheduler;
+    boost::thread schedulerThread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
+
+    BackgroundSubscriber subscriber;
+    RegisterBackgroundValidationInterface(&subscriber);
+
+    std::vector<uint256> vExpected;
+    for (int i = 0; i < 50; i++) {
+        // The transaction is gone before the subscriber gets to it.
+        {
+            CMutableTransaction mtx;
+            mtx.nLockTime = i;
+            CTransaction tx(mtx);
+            vExpected.push_back(tx.GetHash());
+            GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+        }
+        vExpected.push_back(GetRandHash());
+        GetMainSignals().UpdatedTransaction(vExpected.back());
+    }
+    SyncWithValidationInterfaceQueue();
+    BOOST_CHECK(subscriber.vHashes == vExpected);
+    BOOST_CHECK(subscriber.threadId == schedulerThread.get_id());
+    BOOST_CHECK_EQUAL(GetMainSignals().CallbacksPending(), 0U);
+
+    // Once unregistered, nothing more is queued for it.
+    UnregisterBackgroundValidationInterface(&subscriber);
+    GetMainSignals().UpdatedTransaction(GetRandHash());
+    SyncWithValidationInterfaceQueue();
+    BOOST_CHECK_EQUAL(subscriber.vHashes.size(), vExpected.size());
+
+    scheduler.stop(true);
+    schedulerThread.join();
+    GetMainSignals().FlushBackgroundCallbacks();
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,9 +1,11 @@
 #include <boost/test/unit_test.hpp>
 
+#include "hash.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "crypto/scrypt.h"
+#include "hash/yescrypt/yescrypt-hash.h"
 
 BOOST_AUTO_TEST_SUITE(scrypt_tests)
 
@@ -32,4 +34,38 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+static const int YESCRYPT_HASHCOUNT = 3;
+
+BOOST_AUTO_TEST_CASE(yescrypt_hash_many_test)
+{
+    // Batch hashing must match single hashing, both for the pair hashed by
+    // the interleaved kernel and for the odd one out
+    const char* expected[YESCRYPT_HASHCOUNT] = { "0a79faddcaa286775b1895e4d9878ba476897a9ebfebe0107364149597df4979", "16f293eb1fcafc45d4fc7e78f75069d6eb264a3624793d1e3bb7c173e6f28266", "2776a4c1a7a43538f0bf2f65d39940c5f1074f9cfdda5abee03e86bf900e2f90" };
+    std::vector<char> inputs(80 * YESCRYPT_HASHCOUNT);
+    for (int k = 0; k < YESCRYPT_HASHCOUNT; k++)
+        for (int i = 0; i < 80; i++)
+            inputs[80 * k + i] = (char)(i * 7 + k * 13);
+    std::vector<uint256> hashes(YESCRYPT_HASHCOUNT);
+    yescrypt_hash_many(&inputs[0], BEGIN(hashes[0]), YESCRYPT_HASHCOUNT);
+    for (int k = 0; k < YESCRYPT_HASHCOUNT; k++) {
+        uint256 hash;
+        yescrypt_hash(&inputs[80 * k], BEGIN(hash));
+        BOOST_CHECK_EQUAL(hash.ToString(), expected[k]);
+        BOOST_CHECK_EQUAL(hashes[k].ToString(), expected[k]);
+    }
+
+    // Contexts reuse their scratch memory across calls, with or without huge pages
+    for (int fHugePages = 0; fHugePages < 2; fHugePages++) {
+        YescryptContext context(fHugePages);
+        std::vector<uint256> ctxhashes(YESCRYPT_HASHCOUNT);
+        context.HashMany(&inputs[0], BEGIN(ctxhashes[0]), YESCRYPT_HASHCOUNT);
+        for (int k = 0; k < YESCRYPT_HASHCOUNT; k++) {
+            uint256 hash;
+            context.Hash(&inputs[80 * k], BEGIN(hash));
+            BOOST_CHECK_EQUAL(hash.ToString(), expected[k]);
+            BOOST_CHECK_EQUAL(ctxhashes[k].ToString(), expected[k]);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,13 +7,18 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
 #include "uint256.h"
+#include "ui_interface.h"
+#include "util.h"
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -24,20 +29,123 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+//! Amount of changes to write to the database at once while upgrading it
+static const size_t DB_UPGRADE_BATCH_SIZE = 16 << 20;
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+//! Outpoints queued for prefetching beyond this many are ignored
+static const size_t MAX_PREFETCH_QUEUE = 100000;
+
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+}
+
+/**
+ * Coins are looked up at random across the whole chain state, so keep as
+ * many tables open as LevelDB will memory map on 64-bit systems; reopening
+ * one means reading its index and filter again. Mapped tables do not hold
+ * file descriptors, but on 32-bit Unix they are plain open files.
+ */
+static CDBOptions ChainstateDBOptions()
 {
+    CDBOptions dbOptions;
+#ifndef WIN32
+    if (sizeof(void*) >= 8)
+#endif
+        dbOptions.nMaxOpenFiles = 1000;
+    return dbOptions;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, int nPrefetchThreads, bool fBackgroundWriteIn) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, ChainstateDBOptions()), fBackgroundWrite(fBackgroundWriteIn), nPendingUsage(0), fWriteFailed(false)
+{
+    for (int i = 0; i < nPrefetchThreads; i++)
+        threadsPrefetch.create_thread(boost::bind(&CCoinsViewDB::ThreadPrefetch, this));
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    Sync();
+    threadsPrefetch.interrupt_all();
+    threadsPrefetch.join_all();
+}
+
+void CCoinsViewDB::Prefetch(const std::vector<COutPoint> &vOutPoints) {
+    if (threadsPrefetch.size() == 0)
+        return;
+    boost::unique_lock<boost::mutex> lock(csPrefetch);
+    for (const COutPoint& outpoint : vOutPoints) {
+        if (queuePrefetch.size() >= MAX_PREFETCH_QUEUE)
+            break;
+        if (setPrefetch.insert(outpoint).second)
+            queuePrefetch.push_back(outpoint);
+    }
+    condPrefetch.notify_all();
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(std::make_pair(DB_COINS, txid), coins);
+void CCoinsViewDB::ThreadPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    while (true) {
+        boost::this_thread::interruption_point();
+        COutPoint outpoint;
+        {
+            boost::unique_lock<boost::mutex> lock(csPrefetch);
+            while (queuePrefetch.empty())
+                condPrefetch.wait(lock); // Interruption point
+            outpoint = queuePrefetch.front();
+            queuePrefetch.pop_front();
+            setPrefetch.erase(outpoint);
+        }
+        HaveCoin(outpoint);
+    }
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::shared_lock<boost::shared_mutex> lock(csPending);
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(std::make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::shared_lock<boost::shared_mutex> lock(csPending);
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end())
+            return !it->second.coin.IsSpent();
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::shared_lock<boost::shared_mutex> lock(csPending);
+        if (!hashPending.IsNull())
+            return hashPending;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -45,28 +153,96 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // Writes have to reach the database in order.
+    if (!Sync())
+        return false;
+    if (!fBackgroundWrite)
+        return WriteCoins(mapCoins, hashBlock, true);
+
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nUsage += it->second.coin.DynamicMemoryUsage();
+    {
+        boost::unique_lock<boost::shared_mutex> lock(csPending);
+        mapPending.swap(mapCoins);
+        hashPending = hashBlock;
+        nPendingUsage = nUsage;
+    }
+    threadWrite = boost::thread(&CCoinsViewDB::ThreadWrite, this);
+    return true;
+}
+
+bool CCoinsViewDB::WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(std::make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(std::make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            it++;
+        }
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    bool fOk = db.WriteBatch(batch);
+    if (LogAcceptCategory("leveldb")) {
+        CDBStats stats;
+        db.GetStats(stats);
+        LogPrint("leveldb", "Chain state database: %s\n", stats.ToString());
+    }
+    return fOk;
+}
+
+void CCoinsViewDB::ThreadWrite() {
+    RenameThread("bitcoin-coinsflush");
+    // Lookups only read mapPending, and nothing else changes it until this
+    // thread is joined, so it can be written out without holding the lock.
+    bool fOk = false;
+    try {
+        fOk = WriteCoins(mapPending, hashPending, false);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    if (!fOk) {
+        // Keep answering lookups from the coins, as the database lacks them.
+        fWriteFailed = true;
+        return;
+    }
+    CCoinsMap mapWritten;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(csPending);
+        mapWritten.swap(mapPending);
+        hashPending.SetNull();
+        nPendingUsage = 0;
+    }
+}
+
+bool CCoinsViewDB::Sync() {
+    if (threadWrite.joinable())
+        threadWrite.join();
+    return !fWriteFailed;
 }
 
+size_t CCoinsViewDB::PendingMemoryUsage() const {
+    boost::shared_lock<boost::shared_mutex> lock(csPending);
+    return nPendingUsage;
+}
+
+// The block index is read in full at startup and otherwise written in
+// batches, so it keeps the default settings.
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -92,29 +268,44 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
-    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    CDBIterator *pcursor = const_cast<CDBWrapper*>(&db)->NewIterator();
+    // Read the best block through the iterator rather than GetBestBlock(), so
+    // that it matches the coins on disk even while a background write is
+    // still in progress.
+    uint256 hashBestChain;
+    char key;
+    pcursor->Seek(DB_BEST_BLOCK);
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key != DB_BEST_BLOCK || !pcursor->GetValue(hashBestChain))
+        hashBestChain.SetNull();
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(pcursor, hashBestChain);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -124,14 +315,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -203,6 +398,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
                 // While it is technically feasible to verify the PoW, doing so takes several minutes as it
                 // requires recomputing every PoW hash during every Vertoreum startup.
                 // We opt instead to simply trust the data that is on your local disk.
+                // Entries carrying BLOCK_POW_VERIFIED had their PoW hash checked when first accepted,
+                // which lets ReadBlockFromDisk() skip recomputing it for their blocks.
                 //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
                 //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
@@ -217,3 +414,124 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+namespace {
+
+//! Legacy class to deserialize pre-pertxout database entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    LogPrintf("Upgrading UTXO database to per-output records...\n");
+    uiInterface.InitMessage(_("Upgrading UTXO database"));
+    size_t count = 0;
+    int reportDone = 0;
+    CDBBatch batch(db);
+    std::pair<unsigned char, uint256> key;
+    std::pair<unsigned char, uint256> prev_key = std::make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > DB_UPGRADE_BATCH_SIZE) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange({DB_COINS, uint256()}, key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
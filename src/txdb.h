@@ -10,12 +10,18 @@
 #include "dbwrapper.h"
 #include "chain.h"
 
+#include <deque>
 #include <map>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -41,6 +47,12 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! -dbprefetch default (number of threads reading coins ahead of block validation)
+static const int DEFAULT_DB_PREFETCH_THREADS = 4;
+//! max. -dbprefetch
+static const int MAX_DB_PREFETCH_THREADS = 16;
+//! -dbasyncflush default
+static const bool DEFAULT_DB_ASYNC_FLUSH = true;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -67,19 +79,71 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * With nPrefetchThreads > 0, outpoints passed to Prefetch() are looked up by
+ * that many background threads. The results are dropped: the lookups only
+ * serve to pull the database blocks holding the coins into LevelDB's and
+ * the operating system's caches, so that the synchronous reads done later
+ * by block validation do not wait for the disk, and nothing is kept that a
+ * later write could make stale.
+ *
+ * With fBackgroundWrite, BatchWrite takes over the coins it is given and
+ * returns at once, leaving a background thread to write them in a single
+ * batch (together with the best block, so the database on disk always
+ * matches some block). Until the write completes, lookups are answered from
+ * those coins first. Only one such write is outstanding: the next
+ * BatchWrite, and Sync(), wait for it.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, int nPrefetchThreads = 0, bool fBackgroundWriteIn = false);
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Only covers what is on disk: call Sync() first
     CCoinsViewCursor *Cursor() const;
+    void Prefetch(const std::vector<COutPoint> &vOutPoints);
+
+    //! Wait for a background write to finish. Returns false if it, or an earlier one, failed.
+    bool Sync();
+
+    //! Memory held by coins that are still being written in the background
+    size_t PendingMemoryUsage() const;
+
+    //! Statistics of the underlying database
+    void GetDBStats(CDBStats& stats) const { db.GetStats(stats); }
+
+    //! Attempt to update from an older database format. Returns false if it failed or was interrupted.
+    bool Upgrade();
+
+private:
+    bool WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
+    void ThreadWrite();
+    void ThreadPrefetch();
+
+    const bool fBackgroundWrite;
+    //! Coins handed to BatchWrite that are being written in the background
+    mutable boost::shared_mutex csPending;
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    size_t nPendingUsage;
+    boost::thread threadWrite;
+    bool fWriteFailed;
+
+    boost::mutex csPrefetch;
+    boost::condition_variable condPrefetch;
+    //! Outpoints waiting to be read, and the same set for deduplication
+    std::deque<COutPoint> queuePrefetch;
+    std::unordered_set<COutPoint, SaltedOutpointHasher> setPrefetch;
+    boost::thread_group threadsPrefetch;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -88,8 +152,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -99,7 +163,7 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     std::unique_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
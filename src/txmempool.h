@@ -24,6 +24,7 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include "boost/multi_index/sequenced_index.hpp"
 
 #include <boost/signals2/signal.hpp>
 
@@ -42,7 +43,7 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 struct LockPoints
@@ -112,6 +113,9 @@ private:
     int64_t nSigOpCostWithAncestors;
 
 public:
+    //! Last mempool graph walk that visited this entry (see CTxMemPool::EpochGuard)
+    mutable uint64_t nEpoch;
+
     CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                     CAmount _inChainInputValue, bool spendsCoinbase,
@@ -220,6 +224,11 @@ struct mempoolentry_txid
     {
         return entry.GetTx().GetHash();
     }
+
+    result_type operator() (const CTransactionRef& tx) const
+    {
+        return tx->GetHash();
+    }
 };
 
 /** \class CompareTxMemPoolEntryByDescendantScore
@@ -420,12 +429,17 @@ enum class MemPoolRemovalReason {
  * prevent these calculations from being too CPU intensive.
  *
  * Adding transactions from a disconnected block can be very time consuming,
- * because we don't have a way to limit the number of in-mempool descendants.
- * To bound CPU processing, we limit the amount of work we're willing to do
- * to properly update the descendant information for a tx being added from
- * a disconnected block.  If we would exceed the limit, then we instead mark
- * the entry as "dirty", and set the feerate for sorting purposes to be equal
- * the feerate of the transaction without any descendants.
+ * because nothing limited the number of in-mempool descendants of a
+ * transaction while it was confirmed. To bound CPU processing,
+ * UpdateTransactionsFromBlock() only links a transaction from a disconnected
+ * block to its in-mempool children if the result stays within the descendant
+ * limits, and evicts the children otherwise; checking this walks no more
+ * than the limit allows.  A transaction that still ends up past the limits
+ * through the in-mempool descendants of its in-block children has all of its
+ * in-mempool descendants evicted.
+ *
+ * Graph walks mark the entries they visit with an epoch (see EpochGuard)
+ * rather than collecting them in a temporary set.
  *
  */
 class CTxMemPool
@@ -442,6 +456,9 @@ private:
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    mutable uint64_t nEpoch;      //!< Current graph walk, entries visited by it are marked with it
+    mutable bool fHasEpochGuard;  //!< Whether a graph walk is in progress
+
     void trackPackageRemoved(const CFeeRate& rate);
 
 public:
@@ -495,8 +512,32 @@ public:
 
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * Starts a new walk of the mempool graph for as long as it is in scope.
+     * Instead of collecting the entries seen so far in a temporary set, a
+     * walk marks them with its epoch through visited(). Walks cannot nest;
+     * cs must be held.
+     */
+    class EpochGuard
+    {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& poolIn);
+        ~EpochGuard();
+    };
+
+    /** Mark it as seen by the current walk, returning whether it already was. */
+    bool visited(txiter it) const
+    {
+        assert(fHasEpochGuard);
+        if (it->nEpoch == nEpoch)
+            return true;
+        it->nEpoch = nEpoch;
+        return false;
+    }
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
         setEntries parents;
@@ -542,10 +583,10 @@ public:
     void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight);
 
     void clear();
+    bool isSpent(const COutPoint& outpoint);
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -577,8 +618,13 @@ public:
      *  child transactions present in hashesToUpdate, which are already accounted
      *  for).  Note: hashesToUpdate should be the set of transactions from the
      *  disconnected block that have been accepted back into the mempool.
+     *
+     *  The work is bounded by the package limits: children that would take a
+     *  transaction past the descendant limits are not linked to it, and are
+     *  removed along with their descendants, as are descendants that end up
+     *  past the ancestor limits.
      */
-    void UpdateTransactionsFromBlock(const std::vector<uint256> &hashesToUpdate);
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &hashesToUpdate, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize);
 
     /** Try to calculate all in-mempool ancestors of entry.
      *  (these are all calculated including the tx itself)
@@ -609,7 +655,7 @@ public:
       *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
       *  which are not in mempool which no longer have any spends in this mempool.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -635,6 +681,13 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    bool exists(const COutPoint& outpoint) const
+    {
+        LOCK(cs);
+        auto it = mapTx.find(outpoint.hash);
+        return (it != mapTx.end() && outpoint.n < it->GetTx().vout.size());
+    }
+
     CTransactionRef get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
@@ -665,6 +718,8 @@ public:
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
+    /** Fired when PrioritiseTransaction changes the modified fee of an entry */
+    boost::signals2::signal<void (CTransactionRef)> NotifyEntryPrioritised;
 
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
@@ -679,10 +734,20 @@ private:
      *  cachedDescendants will be updated with the descendants of the transaction
      *  being updated, so that future invocations don't need to walk the
      *  same transaction again, if encountered in another transaction chain.
+     *
+     *  Descendants that end up past the ancestor limits are added to
+     *  setRemove; they cannot be removed here without invalidating
+     *  cachedDescendants.
      */
     void UpdateForDescendants(txiter updateIt,
             cacheMap &cachedDescendants,
-            const std::set<uint256> &setExclude);
+            const std::set<uint256> &setExclude,
+            std::set<uint256> &setRemove,
+            uint64_t limitAncestorCount,
+            uint64_t limitAncestorSize);
+    /** Whether linking vChildren (and their in-mempool descendants) to updateIt
+     *  keeps it within the descendant limits. Stops walking once they are exceeded. */
+    bool NewChildrenWithinLimits(txiter updateIt, const std::vector<txiter> &vChildren, uint64_t limitDescendantCount, uint64_t limitDescendantSize) const;
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
     void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
     /** Set ancestor state for an entry */
@@ -716,8 +781,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 // We want to sort transactions by coin age priority
@@ -733,4 +798,56 @@ struct TxCoinAgePriorityCompare
     }
 };
 
+/**
+ * DisconnectedBlockTransactions
+ *
+ * Transactions of blocks disconnected during a reorg, kept until the reorg
+ * is over so they can be returned to the mempool in one pass instead of
+ * after every DisconnectTip. Blocks are disconnected from the tip down, and
+ * each block's transactions are added in reverse, so the insertion order is
+ * the reverse of dependency order: walking it backwards visits every
+ * transaction after the ones it spends.
+ *
+ * Transactions confirmed again by a block connected later in the same reorg
+ * are dropped with removeForBlock(). Memory is bounded by the caller, which
+ * evicts the oldest entries (and their mempool descendants) once
+ * DynamicMemoryUsage() exceeds MAX_DISCONNECTED_TX_POOL_SIZE.
+ */
+struct txid_index {};
+struct insertion_order {};
+
+struct DisconnectedBlockTransactions {
+    typedef boost::multi_index_container<
+        CTransactionRef,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<
+                boost::multi_index::tag<txid_index>,
+                mempoolentry_txid,
+                SaltedTxidHasher
+            >,
+            // sorted by order in the blockchain
+            boost::multi_index::sequenced<
+                boost::multi_index::tag<insertion_order>
+            >
+        >
+    > indexed_disconnected_transactions;
+
+    indexed_disconnected_transactions queuedTx;
+    uint64_t cachedInnerUsage;
+
+    DisconnectedBlockTransactions() : cachedInnerUsage(0) {}
+
+    // Callers must empty the pool (UpdateMempoolForReorg) before destroying
+    // it, or the transactions would silently be dropped from the mempool.
+    ~DisconnectedBlockTransactions() { assert(queuedTx.empty()); }
+
+    size_t DynamicMemoryUsage() const;
+    void addTransaction(const CTransactionRef& tx);
+    /** Drop transactions that a newly connected block confirms again. */
+    void removeForBlock(const std::vector<CTransactionRef>& vtx);
+    void removeEntry(indexed_disconnected_transactions::index<insertion_order>::type::iterator entry);
+    void clear();
+};
+
 #endif // BITCOIN_TXMEMPOOL_H
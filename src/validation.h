@@ -35,9 +35,11 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewDB;
 class CChainParams;
 class CInv;
 class CConnman;
+class CPubKeyParseCache;
 class CScriptCheck;
 class CTxMemPool;
 class CValidationInterface;
@@ -69,6 +71,8 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Maximum kilobytes of transactions from disconnected blocks kept for the mempool during a reorg */
+static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -80,6 +84,8 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -powhugepages, back the yescrypt scratch memory of PoW check threads with huge pages */
+static const bool DEFAULT_POW_HUGEPAGES = false;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -166,6 +172,7 @@ extern CConditionVariable cvBlockChange;
 extern std::atomic_bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern bool fPoWHugePages;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
@@ -201,6 +208,7 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6 * 4;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+static const bool DEFAULT_VERIFYINDEXPOW = false;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -263,6 +271,8 @@ bool LoadBlockIndex(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header proof-of-work checking thread */
+void ThreadPoWCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -366,10 +376,12 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. If pkcache is not NULL, the script checks parse public keys
+ * through it, and it must outlive them.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL,
+                 CPubKeyParseCache* pkcache = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -444,12 +456,13 @@ private:
     bool cacheStore;
     ScriptError error;
     PrecomputedTransactionData *txdata;
+    CPubKeyParseCache *pkcache;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0), pkcache(0) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn, CPubKeyParseCache* pkcacheIn = NULL) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn), pkcache(pkcacheIn) { }
 
     bool operator()();
 
@@ -462,16 +475,60 @@ public:
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
         std::swap(txdata, check.txdata);
+        std::swap(pkcache, check.pkcache);
     }
 
     ScriptError GetScriptError() const { return error; }
 };
 
+/** Number of headers one CPoWCheck hashes together: the lanes of the yescrypt kernel */
+static const unsigned int POW_CHECK_HEADERS = 2;
+
+/**
+ * Closure representing the proof-of-work verification of up to
+ * POW_CHECK_HEADERS block headers, hashed together. Stores references to the
+ * headers, and sets *pfValid of each header that passes so that the caller
+ * can tell which headers of a batch were verified.
+ */
+class CPoWCheck
+{
+private:
+    const CBlockHeader *pheaders[POW_CHECK_HEADERS];
+    char *pfValid[POW_CHECK_HEADERS];
+    unsigned int nHeaders;
+    const Consensus::Params *pparams;
+
+public:
+    CPoWCheck(): nHeaders(0), pparams(0) {}
+    explicit CPoWCheck(const Consensus::Params& paramsIn) : nHeaders(0), pparams(&paramsIn) { }
+
+    /** Add a header to the check, returning false if it already holds POW_CHECK_HEADERS. */
+    bool Add(const CBlockHeader& header, char* pfValidIn) {
+        if (nHeaders == POW_CHECK_HEADERS)
+            return false;
+        pheaders[nHeaders] = &header;
+        pfValid[nHeaders] = pfValidIn;
+        nHeaders++;
+        return true;
+    }
+
+    bool operator()();
+
+    void swap(CPoWCheck &check) {
+        std::swap(pheaders, check.pheaders);
+        std::swap(pfValid, check.pfValid);
+        std::swap(nHeaders, check.nHeaders);
+        std::swap(pparams, check.pparams);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block as stored on disk, which is its serialization with witness data, without parsing it. */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -500,6 +557,24 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+/** What a block's transactions need from the chain: the script flags in force and a private copy of the coins they touch. */
+struct CBlockValiditySnapshot
+{
+    CBlockIndex* pindexPrev;
+    unsigned int flags;
+    CCoinsView viewEmpty;
+    CCoinsViewCache view;
+
+    CBlockValiditySnapshot() : pindexPrev(NULL), flags(0), view(&viewEmpty) {}
+};
+
+/** Run the context checks of TestBlockValidity and fill snapshot for TestBlockValiditySnapshot (with cs_main held) */
+bool PrepareBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev,
+                          CBlockValiditySnapshot& snapshot, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+
+/** Connect a prepared block's transactions to its snapshot, with the script checks spread over the script check threads. Does not need cs_main. */
+bool TestBlockValiditySnapshot(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockValiditySnapshot& snapshot);
+
 /** Check whether witness commitments are required for block. */
 bool IsWitnessEnabled(const CBlockIndex* pindexPrev, const Consensus::Params& params);
 
@@ -520,6 +595,13 @@ public:
     bool VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview, int nCheckLevel, int nCheckDepth);
 };
 
+/**
+ * Recompute and check the proof of work of every block index entry, spread
+ * over the PoW check threads, marking them BLOCK_POW_VERIFIED. Returns false
+ * if an entry fails the check.
+ */
+bool VerifyBlockIndexPoW(const Consensus::Params& consensusParams);
+
 /** Find the last common block between the parameter chain and a locator. */
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator);
 
@@ -538,6 +620,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database backing pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
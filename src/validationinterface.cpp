@@ -5,8 +5,56 @@
 
 #include "validationinterface.h"
 
+#include "chain.h"
+#include "primitives/transaction.h"
+#include "scheduler.h"
+
+#include <future>
+#include <map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
 static CMainSignals g_signals;
 
+//! Connections of background subscribers, which are lambdas that cannot be disconnected by value
+static boost::mutex csBackgroundConnections;
+static std::map<CValidationInterface*, std::vector<boost::signals2::connection> > mapBackgroundConnections;
+
+CMainSignals::CMainSignals() {}
+
+CMainSignals::~CMainSignals() {}
+
+void CMainSignals::RegisterBackgroundSignalScheduler(CScheduler& scheduler)
+{
+    assert(!pschedulerClient);
+    pschedulerClient.reset(new SingleThreadedSchedulerClient(&scheduler));
+}
+
+void CMainSignals::UnregisterBackgroundSignalScheduler()
+{
+    pschedulerClient.reset();
+}
+
+void CMainSignals::FlushBackgroundCallbacks()
+{
+    if (pschedulerClient)
+        pschedulerClient->EmptyQueue();
+}
+
+void CMainSignals::AddToBackgroundQueue(const boost::function<void (void)>& func)
+{
+    if (pschedulerClient)
+        pschedulerClient->AddToProcessQueue(func);
+    else
+        func();
+}
+
+size_t CMainSignals::CallbacksPending()
+{
+    return pschedulerClient ? pschedulerClient->CallbacksPending() : 0;
+}
+
 CMainSignals& GetMainSignals()
 {
     return g_signals;
@@ -39,6 +87,10 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
 }
 
 void UnregisterAllValidationInterfaces() {
+    {
+        boost::unique_lock<boost::mutex> lock(csBackgroundConnections);
+        mapBackgroundConnections.clear();
+    }
     g_signals.BlockFound.disconnect_all_slots();
     g_signals.ScriptForMining.disconnect_all_slots();
     g_signals.BlockChecked.disconnect_all_slots();
@@ -50,3 +102,52 @@ void UnregisterAllValidationInterfaces() {
     g_signals.UpdatedBlockTip.disconnect_all_slots();
     g_signals.NewPoWValidBlock.disconnect_all_slots();
 }
+
+void RegisterBackgroundValidationInterface(CValidationInterface* pwalletIn) {
+    std::vector<boost::signals2::connection> vConnections;
+    vConnections.push_back(g_signals.UpdatedBlockTip.connect([pwalletIn](const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->UpdatedBlockTip(pindexNew, pindexFork, fInitialDownload); });
+    }));
+    vConnections.push_back(g_signals.SyncTransaction.connect([pwalletIn](const CTransaction& tx, const CBlockIndex* pindex, int posInBlock) {
+        // The caller's transaction may be gone by the time the callback runs.
+        std::shared_ptr<const CTransaction> ptx = std::make_shared<const CTransaction>(tx);
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->SyncTransaction(*ptx, pindex, posInBlock); });
+    }));
+    vConnections.push_back(g_signals.UpdatedTransaction.connect([pwalletIn](const uint256& hash) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->UpdatedTransaction(hash); });
+    }));
+    vConnections.push_back(g_signals.SetBestChain.connect([pwalletIn](const CBlockLocator& locator) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->SetBestChain(locator); });
+    }));
+    vConnections.push_back(g_signals.Inventory.connect([pwalletIn](const uint256& hash) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->Inventory(hash); });
+    }));
+    vConnections.push_back(g_signals.BlockFound.connect([pwalletIn](const uint256& hash) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->ResetRequestCount(hash); });
+    }));
+    vConnections.push_back(g_signals.NewPoWValidBlock.connect([pwalletIn](const CBlockIndex* pindex, const std::shared_ptr<const CBlock>& block) {
+        g_signals.AddToBackgroundQueue([=] { pwalletIn->NewPoWValidBlock(pindex, block); });
+    }));
+
+    boost::unique_lock<boost::mutex> lock(csBackgroundConnections);
+    std::vector<boost::signals2::connection>& vRegistered = mapBackgroundConnections[pwalletIn];
+    vRegistered.insert(vRegistered.end(), vConnections.begin(), vConnections.end());
+}
+
+void UnregisterBackgroundValidationInterface(CValidationInterface* pwalletIn) {
+    boost::unique_lock<boost::mutex> lock(csBackgroundConnections);
+    std::map<CValidationInterface*, std::vector<boost::signals2::connection> >::iterator it = mapBackgroundConnections.find(pwalletIn);
+    if (it == mapBackgroundConnections.end())
+        return;
+    for (boost::signals2::connection& connection : it->second)
+        connection.disconnect();
+    mapBackgroundConnections.erase(it);
+}
+
+void SyncWithValidationInterfaceQueue() {
+    // The queue runs in order, so once this callback has run, so have all
+    // those queued before it.
+    std::promise<void> promise;
+    g_signals.AddToBackgroundQueue([&promise] { promise.set_value(); });
+    promise.get_future().wait();
+}
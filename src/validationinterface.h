@@ -6,6 +6,7 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include <boost/function.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 #include <memory>
@@ -16,9 +17,11 @@ struct CBlockLocator;
 class CBlockIndex;
 class CConnman;
 class CReserveScript;
+class CScheduler;
 class CTransaction;
 class CValidationInterface;
 class CValidationState;
+class SingleThreadedSchedulerClient;
 class uint256;
 
 // These functions dispatch to one or all registered wallets
@@ -29,6 +32,26 @@ void RegisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
+/**
+ * Register a subscriber that is notified in the background: its callbacks
+ * are queued, in order, and run on the scheduler passed to
+ * CMainSignals::RegisterBackgroundSignalScheduler instead of inline, where
+ * most signals are sent with cs_main held. It gets copies of the data, and
+ * is not sent BlockChecked, ScriptForMining or Broadcast, which are about
+ * data or answers their callers only hold, or need, for the duration of the
+ * call.
+ */
+void RegisterBackgroundValidationInterface(CValidationInterface* pwalletIn);
+/**
+ * Unregister a background subscriber. Callbacks already queued for it may
+ * still run: call SyncWithValidationInterfaceQueue() before destroying it.
+ */
+void UnregisterBackgroundValidationInterface(CValidationInterface* pwalletIn);
+/**
+ * Wait until every callback queued for background subscribers so far has
+ * run. Must not be called with cs_main held, as those callbacks may take it.
+ */
+void SyncWithValidationInterfaceQueue();
 
 class CValidationInterface {
 protected:
@@ -45,6 +68,7 @@ protected:
     friend void ::RegisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
+    friend void ::RegisterBackgroundValidationInterface(CValidationInterface*);
 };
 
 struct CMainSignals {
@@ -79,6 +103,21 @@ struct CMainSignals {
      * Notifies listeners that a block which builds directly on our current tip
      * has been received and connected to the headers tree, though not validated yet */
     boost::signals2::signal<void (const CBlockIndex *, const std::shared_ptr<const CBlock>&)> NewPoWValidBlock;
+
+    /** Run the callbacks of background subscribers on this scheduler */
+    void RegisterBackgroundSignalScheduler(CScheduler& scheduler);
+    void UnregisterBackgroundSignalScheduler();
+    /** Run the queued callbacks on the calling thread, once the scheduler has stopped */
+    void FlushBackgroundCallbacks();
+    /** Queue a callback for background subscribers, or run it now if no scheduler is registered */
+    void AddToBackgroundQueue(const boost::function<void (void)>& func);
+    size_t CallbacksPending();
+
+    CMainSignals();
+    ~CMainSignals();
+
+private:
+    std::unique_ptr<SingleThreadedSchedulerClient> pschedulerClient;
 };
 
 CMainSignals& GetMainSignals();